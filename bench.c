@@ -0,0 +1,669 @@
+/*
+ * See LICENSE file for copyright and licence details.
+ *
+ * This is a benchmark for utfset.c, which times insertion, membership tests
+ * and iteration over a number of fixed corpora, and reports how much memory
+ * the resulting sets take up. It can be built and run like so:
+ *
+ *	cc -std=c11 -O2 -pthread -o bench bench.c
+ *	./bench [megabytes]
+ *
+ * The corpora are generated from a fixed seed, so that every run measures the
+ * same input: ASCII source code, Chinese news, emoji-laden chat, and random
+ * valid code points. Each is the given number of megabytes long (by default 8).
+ */
+#include "utfset.c"
+
+#include <time.h>
+
+/*
+ * rnd() is a xorshift generator, which is plenty for our purposes, and means
+ * the corpora are the same from one platform to the next.
+ */
+static uint64_t seed;
+
+static uint64_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+/*
+ * The corpora are built up a rune at a time, each from its own generator, in
+ * a buffer which is then cut down to the last whole rune in the given length.
+ * The runes are also kept decoded, for addrune() and hasrune(), and encoded as
+ * UTF-16, for addutf16().
+ */
+struct corpus {
+	const char *name;
+	char32_t (*gen)(void);
+	char *buf;
+	char32_t *rbuf;
+	char16_t *wbuf;
+	size_t len, runes, wlen;
+};
+
+/*
+ * gensrc() produces something resembling C source code: mostly lowercase
+ * identifiers and keywords, with punctuation, indentation and newlines.
+ */
+static char32_t
+gensrc(void)
+{
+	static const char punct[] = "(){}[];,.*&=+-<>!/\"'#_";
+	static unsigned int left = 0;
+	uint64_t x = rnd();
+
+	if (left > 0) {
+		left--;
+		return 'a' + x % 26;
+	}
+	switch (x % 16) {
+	case 0:
+		return '\n';
+	case 1:
+		return '\t';
+	case 2: case 3: case 4:
+		return ' ';
+	case 5: case 6:
+		return punct[(x >> 8) % (sizeof(punct) - 1)];
+	case 7:
+		return '0' + (x >> 8) % 10;
+	case 8:
+		return 'A' + (x >> 8) % 26;
+	default:
+		left = (x >> 8) % 8;
+		return 'a' + (x >> 16) % 26;
+	}
+}
+
+/*
+ * genzh() produces something resembling Chinese news: CJK ideographs, skewed
+ * toward the first few thousand (which is where the common ones are), with
+ * CJK punctuation, and the occasional run of digits or Latin letters.
+ */
+static char32_t
+genzh(void)
+{
+	static const char32_t punct[] = {
+		0x3001, 0x3002, 0xFF0C, 0x300C, 0x300D, 0xFF1A, 0xFF1F, 0xFF01,
+	};
+	uint64_t x = rnd();
+
+	switch (x % 32) {
+	case 0: case 1: case 2:
+		return punct[(x >> 8) % 8];
+	case 3:
+		return '0' + (x >> 8) % 10;
+	case 4:
+		return 'A' + (x >> 8) % 26;
+	default:
+		return 0x4E00 + ((x >> 8) % 3500) * ((x >> 24) % 6 + 1);
+	}
+}
+
+/*
+ * genchat() produces something resembling chat messages: mostly ASCII words,
+ * with some accented Latin letters, and emoji, sometimes joined by ZWJ or
+ * followed by a variation selector.
+ */
+static char32_t
+genchat(void)
+{
+	uint64_t x = rnd();
+
+	switch (x % 32) {
+	case 0: case 1: case 2:
+		return 0x1F600 + (x >> 8) % 80;
+	case 3: case 4:
+		return 0x1F300 + (x >> 8) % 768;
+	case 5:
+		return 0x1F900 + (x >> 8) % 256;
+	case 6:
+		return (x >> 8) % 2 ? 0x200D : 0xFE0F;
+	case 7:
+		return 0xC0 + (x >> 8) % 64;
+	case 8: case 9: case 10: case 11: case 12:
+		return ' ';
+	default:
+		return 'a' + (x >> 8) % 26;
+	}
+}
+
+/*
+ * genany() produces random valid code points, that is, anything up to U+10FFFF
+ * except for the UTF-16 surrogates.
+ */
+static char32_t
+genany(void)
+{
+	char32_t r;
+
+	do {
+		r = rnd() % 0x110000;
+	} while (r >= 0xD800 && r < 0xE000);
+	return r;
+}
+
+static void
+mkcorpus(struct corpus *c, size_t len)
+{
+	char *p;
+
+	seed = UINT64_C(88172645463325252);
+	p = c->buf = malloc(len + 4);
+	c->rbuf = malloc((len + 1) * sizeof(char32_t));
+	if (!p || !c->rbuf) {
+		perror("malloc");
+		exit(1);
+	}
+	for (c->runes = 0; p < c->buf + len; c->runes++) {
+		p += runeutf(p, c->rbuf[c->runes] = c->gen());
+	}
+	if (p > c->buf + len) { /* drop the rune that didn't fit */
+		while ((*(unsigned char *)--p & 0300) == 0200)
+			;
+		c->runes--;
+	}
+	c->len = p - c->buf;
+
+	if (!(c->wbuf = malloc(2 * c->runes * sizeof(char16_t)))) {
+		perror("malloc");
+		exit(1);
+	}
+	c->wlen = 0;
+	for (size_t i = 0; i < c->runes; i++) {
+		char32_t r = c->rbuf[i];
+
+		if (r >= 0x10000) {
+			c->wbuf[c->wlen++] = 0xD800 + ((r - 0x10000) >> 10);
+			c->wbuf[c->wlen++] = 0xDC00 + (r - 0x10000) % 1024;
+		} else {
+			c->wbuf[c->wlen++] = r;
+		}
+	}
+}
+
+/*
+ * now() returns the current time in nanoseconds.
+ */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Each benchmark is run this many times, and only the fastest counts, which
+ * gives more stable results than the mean.
+ */
+#define RUNS 5
+
+/*
+ * This is how many threads utfset_build_parallel() is given.
+ */
+#define THREADS 4
+
+/*
+ * This is the size of the chunks fed to utfset_stream_feed(), as from read().
+ */
+#define CHUNK 65536
+
+static volatile size_t sink; /* stops the compiler dropping our results */
+
+static void
+report(const char *what, double ns, size_t n)
+{
+	printf("  %-24s %8.2f ns/rune\n", what, ns / n);
+}
+
+/*
+ * check() makes sure that each thing we time gave the right answer, because a
+ * fast wrong answer is worth nothing. Every corpus is made up of valid UTF-8,
+ * and every set is built from the whole of it, so every lookup is a hit.
+ */
+static void
+check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "bench: %s gave the wrong answer\n", what);
+		exit(1);
+	}
+}
+
+static bool
+allhits(const uint8_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (out[i] != 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+bench(const struct corpus *c)
+{
+	UTFSet set = { 0 }, ref, half[2];
+	FrozenUTFSet frozen;
+	UTFTable table;
+	UTFSetIter it;
+	UTFSetStats st;
+	uint8_t *out;
+	size_t members;
+	double t, best;
+	char32_t r;
+	bool in, ok;
+
+	printf("%s: %zu bytes, %zu runes\n", c->name, c->len, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		const char *s = c->buf, *end = c->buf + c->len;
+
+		utfset_free(&set);
+		t = now();
+		while (s < end) {
+			s = addutf(&set, s);
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("addutf", best, c->runes);
+
+	/*
+	 * The set addutf() built is the one the others should agree with.
+	 */
+	ref = set;
+	set = (UTFSet){ 0 };
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		utfset_free(&set);
+		t = now();
+		addutfs(&set, c->buf, c->len);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("addutfs", best, c->runes);
+	check(utfset_equal(&set, &ref), "addutfs");
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		utfset_free(&set);
+		t = now();
+		addvalidutfs(&set, c->buf, c->len);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("addvalidutfs", best, c->runes);
+	check(utfset_equal(&set, &ref), "addvalidutfs");
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		utfset_free(&set);
+		t = now();
+		for (size_t j = 0; j < c->runes; j++) {
+			addrune(&set, c->rbuf[j]);
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("addrune", best, c->runes);
+	check(utfset_equal(&set, &ref), "addrune");
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		utfset_free(&set);
+		t = now();
+		addutf16(&set, c->wbuf, c->wlen);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("addutf16", best, c->runes);
+	check(utfset_equal(&set, &ref), "addutf16");
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		utfset_free(&set);
+		t = now();
+		utfset_build_parallel(&set, c->buf, c->len, THREADS);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("utfset_build_parallel", best, c->runes);
+	check(utfset_equal(&set, &ref), "utfset_build_parallel");
+
+	/*
+	 * As if reading the corpus in chunks, whose ends split runes.
+	 */
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		UTFSetStream st;
+
+		utfset_free(&set);
+		t = now();
+		utfset_stream_init(&st, &set, false);
+		for (size_t j = 0; j < c->len; j += CHUNK) {
+			utfset_stream_feed(&st, c->buf + j, c->len - j < CHUNK ? c->len - j : CHUNK);
+		}
+		utfset_stream_finish(&st);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+	}
+	report("utfset_stream_feed", best, c->runes);
+	check(utfset_equal(&set, &ref), "utfset_stream_feed");
+
+	/*
+	 * Every rune in the corpus was counted, so the counts of the distinct
+	 * runes add up to the number in the corpus.
+	 */
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		UTFMultiset ms = { 0 };
+		const char *e;
+		size_t total = 0;
+
+		t = now();
+		e = multiset_addutfs(&ms, c->buf, c->len);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		check(e == c->buf + c->len, "multiset_addutfs");
+		utfset_iter_init(&it, &ref);
+		while (utfset_iter_next(&it, &r)) {
+			total += multiset_count(&ms, r);
+		}
+		check(total == c->runes, "multiset_count");
+		multiset_free(&ms);
+	}
+	report("multiset_addutfs", best, c->runes);
+
+	if (utfset_freeze(&frozen, &set) < 0) {
+		perror("utfset_freeze");
+		exit(1);
+	}
+	if (utfset_compile(&table, &set) < 0) {
+		perror("utfset_compile");
+		exit(1);
+	}
+	if (!(out = malloc(c->runes))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		const char *s = c->buf, *end = c->buf + c->len;
+		size_t hits = 0;
+
+		t = now();
+		while (s < end) {
+			s = hasutf(&set, s, &in);
+			hits += in;
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "hasutf");
+	}
+	report("hasutf", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		size_t hits = 0;
+
+		t = now();
+		for (size_t j = 0; j < c->runes; j++) {
+			hits += hasrune(&set, c->rbuf[j]);
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "hasrune");
+	}
+	report("hasrune", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		t = now();
+		hasrunes(&set, c->rbuf, c->runes, out);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = out[c->runes - 1];
+		check(allhits(out, c->runes), "hasrunes");
+	}
+	report("hasrunes", best, c->runes);
+
+	/*
+	 * Every rune of the corpus is in the set, so this spans all of it.
+	 */
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		t = now();
+		sink = utfset_span(&set, c->buf, c->len);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		check(sink == c->len, "utfset_span");
+	}
+	report("utfset_span", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		const char *s = c->buf, *end = c->buf + c->len;
+		size_t hits = 0;
+
+		t = now();
+		while (s < end) {
+			s = frozen_hasutf(&frozen, s, &in);
+			hits += in;
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "frozen_hasutf");
+	}
+	report("frozen_hasutf", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		size_t hits = 0;
+
+		t = now();
+		for (size_t j = 0; j < c->runes; j++) {
+			hits += frozen_hasrune(&frozen, c->rbuf[j]);
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "frozen_hasrune");
+	}
+	report("frozen_hasrune", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		t = now();
+		frozen_hasrunes(&frozen, c->rbuf, c->runes, out);
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = out[c->runes - 1];
+		check(allhits(out, c->runes), "frozen_hasrunes");
+	}
+	report("frozen_hasrunes", best, c->runes);
+
+	/*
+	 * frozen_rank() and frozen_select() aren't timed, but each rune's rank
+	 * should select it again, and the rank of U+110000 should be the number
+	 * of runes in the set.
+	 */
+	ok = frozen_rank(&frozen, 0x110000) == utfset_count(&set);
+	for (size_t j = 0; j < c->runes && ok; j++) {
+		ok = frozen_select(&frozen, frozen_rank(&frozen, c->rbuf[j]), &r) && r == c->rbuf[j];
+	}
+	check(ok, "frozen_rank");
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		const char *s = c->buf, *end = c->buf + c->len;
+		size_t hits = 0;
+
+		t = now();
+		while (s < end) {
+			s = table_hasutf(&table, s, &in);
+			hits += in;
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "table_hasutf");
+	}
+	report("table_hasutf", best, c->runes);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		size_t hits = 0;
+
+		t = now();
+		for (size_t j = 0; j < c->runes; j++) {
+			hits += table_hasrune(&table, c->rbuf[j]);
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = hits;
+		check(hits == c->runes, "table_hasrune");
+	}
+	report("table_hasrune", best, c->runes);
+
+	members = utfset_count(&set);
+
+	best = 1e300;
+	for (int i = 0; i < RUNS; i++) {
+		char32_t last = 0;
+		size_t seen = 0;
+		bool sorted = true;
+
+		t = now();
+		utfset_iter_init(&it, &set);
+		while (utfset_iter_next(&it, &r)) {
+			sorted &= seen == 0 || r > last;
+			last = r;
+			seen++;
+		}
+		if ((t = now() - t) < best) {
+			best = t;
+		}
+		sink = last;
+		check(seen == members && sorted, "utfset_iter_next");
+	}
+	report("utfset_iter_next", best, members);
+
+	utfset_stats(&set, &st);
+	printf("  %zu distinct runes, %zu blocks", members, st.blocks);
+	for (unsigned int d = 0; d < 6 && st.depth[d]; d++) {
+		printf("%sdepth %u: %zu", d ? ", " : " (", d + 1, st.depth[d]);
+	}
+	printf("%s, %zu bitmasks %.1f%% full\n", st.blocks ? ")" : "", st.leaves, 100 * st.fill);
+	printf("  %-24s %8.2f bytes/rune\n", "UTFSet", (double)st.bytes / members);
+	printf("  %-24s %8.2f bytes/rune\n", "FrozenUTFSet",
+	       (double)(frozen.len * sizeof(uint64_t)) / members);
+	printf("  %-24s %8.2f bytes/rune\n", "UTFTable", (double)table.size / members);
+
+	/*
+	 * Deleting every rune in the corpus should leave nothing behind, not
+	 * even the blocks that held them.
+	 */
+	for (const char *s = c->buf, *end = c->buf + c->len; s < end;) {
+		s = delutf(&set, s);
+		check(s != NULL, "delutf");
+	}
+	utfset_stats(&set, &st);
+	check(utfset_count(&set) == 0 && st.blocks == 0, "delutf");
+
+	/*
+	 * Split the corpus in two. The union of the halves should be the whole
+	 * set again; taking them both away from that should leave nothing, with
+	 * no blocks left over; and what's left after taking away just the first
+	 * half should be in the second. The set intersected with either half
+	 * should be that half.
+	 */
+	half[0] = half[1] = (UTFSet){ 0 };
+	for (size_t j = 0; j < c->runes; j++) {
+		check(addrune(&half[j >= c->runes / 2], c->rbuf[j]) == 0, "addrune");
+	}
+	check(utfset_union(&set, &half[0]) == 0 && utfset_union(&set, &half[1]) == 0 &&
+	      utfset_equal(&set, &ref), "utfset_union");
+	check(utfset_subtract(&set, &half[0]) == 0 && utfset_is_subset(&set, &half[1]),
+	      "utfset_subtract");
+	check(utfset_subtract(&set, &half[1]) == 0, "utfset_subtract");
+	utfset_stats(&set, &st);
+	check(utfset_count(&set) == 0 && st.blocks == 0, "utfset_subtract");
+	check(utfset_union(&set, &ref) == 0 && utfset_intersect(&set, &half[1]) == 0 &&
+	      utfset_equal(&set, &half[1]), "utfset_intersect");
+
+	/*
+	 * Merging the halves should give what their union does.
+	 */
+	check(utfset_union(&set, &half[0]) == 0 && utfset_merge(&half[0], &half[1]) == 0 &&
+	      utfset_equal(&half[0], &set), "utfset_merge");
+
+	/*
+	 * The complement should have every valid rune, less the surrogates,
+	 * except those in the set, and complementing it again should give back
+	 * the set, since the corpus is all valid.
+	 */
+	check(utfset_complement(&set) == 0 &&
+	      utfset_count(&set) == 0x110000 - 0x800 - members, "utfset_complement");
+	check(utfset_complement(&set) == 0 && utfset_equal(&set, &ref), "utfset_complement");
+
+	free(out);
+	frozen_free(&frozen);
+	table_free(&table);
+	utfset_free(&set);
+	utfset_free(&ref);
+	utfset_free(&half[0]);
+	utfset_free(&half[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct corpus corpora[] = {
+		{ .name = "ascii source", .gen = gensrc },
+		{ .name = "chinese news", .gen = genzh },
+		{ .name = "emoji chat", .gen = genchat },
+		{ .name = "random code points", .gen = genany },
+	};
+	size_t len = (argc > 1 ? strtoul(argv[1], NULL, 10) : 8) << 20;
+
+	for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+		mkcorpus(&corpora[i], len);
+		bench(&corpora[i]);
+		free(corpora[i].buf);
+		free(corpora[i].rbuf);
+		free(corpora[i].wbuf);
+	}
+	return 0;
+}
@@ -3,15 +3,50 @@
  *
  * This code implements a UTFSet, a set containing Unicode characters (`runes')
  * in a tree structure that mirrors the UTF-8 encoding format. The result is an
- * exceedingly simple data structure, implemented here in under 75 lines of C,
- * which nevertheless takes up less space when storing smaller (and generally
- * more common) runes, and more when storing larger ones. It may not be the most
- * efficient, but it is kind of neat.
+ * exceedingly simple data structure, which nevertheless takes up less space
+ * when storing smaller (and generally more common) runes, and more when storing
+ * larger ones. It may not be the most efficient, but it is kind of neat.
+ *
+ * The set itself, addutf() and hasutf(), is still a few dozen lines of C, not
+ * counting comments. Everything else in this file builds on it: bulk,
+ * validated, UTF-16, ranged, concurrent, parallel and streaming insertion;
+ * deletion; set algebra and comparison; iteration, searching, rank and select;
+ * frozen sets, which can be saved, mapped or emitted as C, and compiled lookup
+ * tables; and the multiset and map variants.
  */
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <uchar.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#define HAVE_PTHREADS
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 /*
  * The structure underlying a UTFSet is a 64-ary tree (a tree whose nodes each
  * have 64 child nodes), with booleans for leaves. With the exception of the
@@ -22,12 +57,16 @@
  * a 64-bit pointer to an array of 64 bools, we store a 64-bit bitmask in the
  * space that would have stored the pointer to the node. As a result, a node is
  * either a 64-bit pointer to an array of 64 child nodes or, in the case of a
- * leaf node, a 64-bit bitmask.
+ * leaf node, a 64-bit bitmask. (A UTFMultiset, described later, has the same
+ * tree, except that in place of each bitmask it points to an array of counts,
+ * and a UTFMap likewise to an array of values.)
  */
 struct block {
 	union child {
 		struct block *ptr;
 		uint64_t bits;
+		struct counts *cnt;
+		struct values *val;
 	} blk[64];
 };
 
@@ -51,8 +90,15 @@ struct block {
  *
  * There is no accommodation for ASCII bytes, i.e. 0xxxxxxx, which are instead
  * dealt with in a special way, described later.
+ *
+ * Alongside the root we keep a pointer to the pool from which the set's blocks
+ * are to be allocated, or NULL if they are simply to be calloc()ed; see below.
+ * Either way, a UTFSet initialised to { 0 } is empty.
  */
-typedef struct block UTFSet;
+typedef struct utfset {
+	union child blk[64];
+	struct utfpool *pool;
+} UTFSet;
 
 /*
  * This table is used to look up the number of leading ones in a 6-bit integer.
@@ -60,7 +106,8 @@ typedef struct block UTFSet;
  * value xxxxxx, then there are n+1 continuation bytes to follow.
  *
  * Note that the final four values, having 4 or more leading ones, are not valid
- * in UTF-8 according to RFC 3629.
+ * in UTF-8 according to RFC 3629. addvalidutfs() rejects them, along with any
+ * other ill-formed sequences.
  */
 const char clo6[] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* 00xxxx */
@@ -69,6 +116,208 @@ const char clo6[] = {
 	2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 6, /* 11xxxx */
 };
 
+/*
+ * ctz64() counts the trailing zeros in a nonzero 64-bit integer, which is the
+ * index of its lowest set bit. Most compilers provide a builtin for this that
+ * makes use of a single instruction; otherwise we have to count for ourselves.
+ */
+static inline unsigned int
+ctz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	unsigned int n = 0;
+
+	for (; !(x & 1); x >>= 1) {
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * clz64() likewise counts the leading zeros in a nonzero 64-bit integer, so
+ * that 63 minus it is the index of its highest set bit.
+ */
+static inline unsigned int
+clz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_clzll(x);
+#else
+	unsigned int n = 0;
+
+	for (; !(x >> 63); x <<= 1) {
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * popcount64() counts the set bits in a 64-bit integer, again with a builtin
+ * where there is one, and otherwise by clearing the lowest set bit until none
+ * are left.
+ */
+static inline unsigned int
+popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	unsigned int n = 0;
+
+	for (; x; x &= x - 1) {
+		n++;
+	}
+	return n;
+#endif
+}
+
+/*
+ * Every block is 512 bytes, and a set may need thousands of them, so instead
+ * of calloc()ing and free()ing each one individually, a set may carve them out
+ * of a UTFPool. A pool allocates page-aligned slabs of blocks, and hands them
+ * out one at a time. Blocks released by utfset_free() go onto a free list, to
+ * be reused before any more of the slabs, so once a pool has grown big enough
+ * for the sets it serves, building and freeing them makes no calls to malloc()
+ * at all. The slabs themselves are only freed by utfpool_free(). A pool can be
+ * shared by many sets, but not between threads.
+ *
+ * The first block of each slab is not handed out, but links it to the next.
+ * Likewise, the first child of each block on the free list links it onward.
+ */
+#define PAGESIZE 4096
+#define SLABSIZE (16 * PAGESIZE)
+
+typedef struct utfpool {
+	struct block *slabs;       /* slabs allocated so far */
+	struct block *next, *end;  /* blocks not yet handed out */
+	struct block *free;        /* blocks handed back */
+} UTFPool;
+
+/*
+ * newblock() allocates a new, empty block from the pool, or from calloc() if
+ * the pool is NULL. It returns NULL if we run out of memory.
+ */
+static struct block *
+newblock(UTFPool *pool)
+{
+	struct block *b;
+
+	if (!pool) {
+		return calloc(1, sizeof(struct block));
+	}
+	if ((b = pool->free)) {
+		pool->free = b->blk[0].ptr;
+	} else {
+		if (pool->next == pool->end) {
+			struct block *slab = aligned_alloc(PAGESIZE, SLABSIZE);
+
+			if (!slab) {
+				return NULL; /* out of memory */
+			}
+			slab->blk[0].ptr = pool->slabs;
+			pool->slabs = slab;
+			pool->next = slab + 1;
+			pool->end = slab + SLABSIZE / sizeof(struct block);
+		}
+		b = pool->next++;
+	}
+	memset(b, 0, sizeof(struct block));
+
+	return b;
+}
+
+/*
+ * freeblock() releases a block back to the pool it came from.
+ */
+static void
+freeblock(UTFPool *pool, struct block *b)
+{
+	if (!pool) {
+		free(b);
+	} else {
+		b->blk[0].ptr = pool->free;
+		pool->free = b;
+	}
+}
+
+/*
+ * utfpool_free() frees every slab the pool has allocated. Any sets that still
+ * have blocks from the pool must not be used afterward, not even to free them.
+ */
+void
+utfpool_free(UTFPool *pool)
+{
+	while (pool->slabs) {
+		struct block *slab = pool->slabs;
+
+		pool->slabs = slab->blk[0].ptr;
+		free(slab);
+	}
+	*pool = (UTFPool){ 0 };
+}
+
+/*
+ * Large ranges of runes, such as all of the CJK ideographs, fill whole blocks,
+ * and the blocks above them, with nothing but set bits. Since all such blocks
+ * at the same depth are identical, rather than each set allocating its own, we
+ * have a single shared full node for each depth: full[0] is a block of full
+ * bitmasks, full[1] is a block of pointers to full[0], and so on. A child with
+ * n bytes still to go after it is full if it points at full[n - 1].
+ *
+ * The shared nodes must never be changed, nor freed. Any operation that would
+ * clear bits beneath one first replaces it with a private copy, which is to say
+ * it copies-on-write. Adding a rune beneath one is simply a no-op.
+ */
+#define X4(x) x, x, x, x
+#define X64(x) X4(X4(X4(x)))
+
+static struct block full[6] = {
+	{ { X64({ .bits = ~UINT64_C(0) }) } },
+	{ { X64({ .ptr = &full[0] }) } },
+	{ { X64({ .ptr = &full[1] }) } },
+	{ { X64({ .ptr = &full[2] }) } },
+	{ { X64({ .ptr = &full[3] }) } },
+	{ { X64({ .ptr = &full[4] }) } },
+};
+
+/*
+ * none is the opposite, an empty block, for span1() and hasrunes() to walk down
+ * into in place of a child that doesn't point anywhere, rather than having to
+ * check for it at every step.
+ */
+static const struct block none;
+
+/*
+ * isfull() says whether a child, with n bytes still to go after it, is full.
+ */
+static inline bool
+isfull(union child t, unsigned int n)
+{
+	return n == 0 ? t.bits == ~UINT64_C(0) : t.ptr == &full[n - 1];
+}
+
+/*
+ * unshare() replaces a full child, with n > 0 bytes still to go after it, with
+ * a private copy that can be changed. Its own children are still full, and so
+ * still shared. Returns -1 if we run out of memory.
+ */
+static int
+unshare(union child *t, unsigned int n, UTFPool *pool)
+{
+	struct block *b;
+
+	if (!(b = newblock(pool))) {
+		return -1; /* out of memory */
+	}
+	*b = full[n - 1];
+	t->ptr = b;
+	return 0;
+}
+
 /*
  * addutf() adds the next rune in the UTF-8 string to the UTFSet, and returns a
  * pointer to the byte following that rune. For clarity of code, we assume the
@@ -96,11 +345,14 @@ addutf(UTFSet *set, const char *s)
 		 * many continuation bytes are expected. All but the final byte
 		 * (which is the bitmask index) is handled by traversing to the
 		 * corresponding child. If the child doesn't point anywhere yet,
-		 * a new block will be allocated for it.
+		 * a new block will be allocated for it. If it is full, then the
+		 * rune is already in the set, so we can skip the remaining bytes.
 		 */
 		for (unsigned int n = clo6[c % 64]; c = *s++, n > 0; n--) {
-			if (!tp->ptr && !(tp->ptr = calloc(1, sizeof(struct block)))) {
+			if (!tp->ptr && !(tp->ptr = newblock(set->pool))) {
 				return NULL; /* out of memory */
+			} else if (tp->ptr == &full[n - 1]) {
+				return s + n;
 			}
 			tp = &tp->ptr->blk[c % 64];
 		}
@@ -131,99 +383,3640 @@ addutf(UTFSet *set, const char *s)
 	return s;
 }
 
-static void foreach1(union child, unsigned int, char32_t, void (*)(char32_t));
+/*
+ * addrune() adds a rune to the UTFSet, returning 0 on success, or -1 if the
+ * rune is beyond U+10FFFF or we run out of memory. Rather than encode the rune
+ * as UTF-8 and then decode it again a byte at a time, we can work out the path
+ * through the tree directly from the rune: the child of the root is found as
+ * described for utfset_add_range(), and the index of each child after that is
+ * just the next 6 bits of the rune, from the top down, since that is all that
+ * each continuation byte would have held.
+ */
+int
+addrune(UTFSet *set, char32_t r)
+{
+	union child *tp;
+	unsigned int n;
+
+	if (r >= 0x110000) {
+		return -1;
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	tp = &set->blk[64 - (64 >> n) + (r >> 6 * (n + 1))];
+	for (; n > 0; n--) {
+		if (!tp->ptr && !(tp->ptr = newblock(set->pool))) {
+			return -1; /* out of memory */
+		} else if (tp->ptr == &full[n - 1]) {
+			return 0; /* already in the set */
+		}
+		tp = &tp->ptr->blk[(r >> 6 * n) % 64];
+	}
+	tp->bits |= UINT64_C(1) << (r % 64);
+
+	return 0;
+}
+
+/*
+ * asciilen() returns the number of ASCII bytes at the start of the string, up
+ * to len. Most text is overwhelmingly ASCII, so where the target supports it
+ * we check whole vectors of bytes at a time for any with its top bit set, and
+ * only look at individual bytes once we find one that does. Without any SIMD
+ * we can still check eight bytes at a time in an ordinary 64-bit word.
+ */
+static size_t
+asciilen(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		if (_mm256_movemask_epi8(v) != 0) {
+			break;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		if (_mm_movemask_epi8(v) != 0) {
+			break;
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vld1q_u8(p + i)) >= 0200) {
+			break;
+		}
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof w);
+		if (w & UINT64_C(0x8080808080808080)) {
+			break;
+		}
+	}
+#endif
+	while (i < len && p[i] < 0200) {
+		i++;
+	}
+	return i;
+}
 
 /*
- * foreach() takes a pointer to a function that takes a rune, and calls that
- * function for each rune in the set, in ascending order.
+ * addutfs() adds every rune in the first len bytes of the UTF-8 string to the
+ * UTFSet, and returns a pointer to the byte following the last rune added. If
+ * that is not s + len then the rune there could not be added: it starts with
+ * a continuation byte, it is cut short by the end of the string, or we ran out
+ * of memory.
  *
- * It may be worth noting that if an overlong UTF-8 sequence is entered into the
- * UTFSet then the runes will not actually be in true ascending order, as the
- * overlong rune will be reached after the `true' rune. However, since overlong
- * UTF-8 sequences are illegal, this is not a problem if the input is sanitised.
+ * Rather than call addutf() for each rune, we handle whole runs of ASCII at a
+ * time, and unroll the descent for the other runes, as described below.
+ *
+ * addvalidutfs() is the same, except that it does not assume the string is
+ * valid UTF-8, and stops at the first byte sequence that is not well-formed.
+ * Both are implemented by addutfs1(), whose check argument says which it is.
  */
-void
-foreach(const UTFSet *set, void (*fcn)(char32_t))
+static const char *addutfs1(UTFSet *, const char *, size_t, bool);
+static size_t validblock(const unsigned char *, size_t);
+
+const char *
+addutfs(UTFSet *set, const char *s, size_t len)
 {
-	/*
-	 * For each possible leading byte (11xxxxxx), we determine the number of
-	 * continuation bytes that will follow it, and unpack the bits that will
-	 * contribute to the value of the rune. That is, all of the bits after
-	 * the leading ones.
-	 */
-	for (unsigned char c = 0; c < 64; c++) {
-		unsigned int n = clo6[c];   /* there are n+1 bytes left */
-		char32_t r = c % (64 >> n); /* unpack bits for the rune */
+	return addutfs1(set, s, len, false);
+}
+
+const char *
+addvalidutfs(UTFSet *set, const char *s, size_t len)
+{
+	return addutfs1(set, s, len, true);
+}
+
+/*
+ * validblock() checks as many whole vectors of bytes from p on as fit in len,
+ * and returns how many bytes that was, or 0 if any of them could not follow
+ * those before them in well-formed UTF-8. It reads the three bytes before p
+ * too, which must be well-formed, and p must be where a rune would start, so
+ * that every rune that starts and ends within the bytes it passes is well-
+ * formed. addutfs1() can then add those runes without checking them one by
+ * one. Without SSSE3 it passes nothing, and leaves every rune to addutfs1().
+ *
+ * With SSSE3 (or AVX2) we use the method of Keiser and Lemire, which uses the
+ * same pshufb nibble lookups as asciispan(). Every error in UTF-8 shows up in
+ * a byte and the one before it: an ASCII byte or a leading byte followed by a
+ * continuation byte it didn't expect, a leading byte followed by no more, or
+ * one of the ranges of Table 3-7 broken by the byte after it. Looking up each
+ * of the byte before's nibbles, and the byte's high nibble, in a table with a
+ * bit for each such error that the nibble is consistent with, the three agree
+ * on a bit only if the pair of bytes is that error. The one thing two bytes
+ * can't tell us is whether a continuation byte after another is one too many,
+ * and for that we look at the bytes two and three before it: it must be the
+ * third or fourth byte of some rune, and no other continuation byte may be.
+ *
+ * Rather than carry the vector before over from one to the next, to line up
+ * the bytes before, we simply load the same bytes again a little earlier, and
+ * we test for errors only once, at the end, as they are so rare. addutfs1()
+ * checks VBLOCK bytes at a time: fewer, and the blocks cost more each to set
+ * up; more, and the processor can no longer check the next block while it is
+ * still adding the runes of the last, which is much of why it costs so little.
+ */
+#define VBLOCK 256
+
+#if defined(__SSSE3__)
+#define SHORT  0x01 /* 11xxxxxx 0xxxxxxx, 11xxxxxx 11xxxxxx */
+#define LONG   0x02 /* 0xxxxxxx 10xxxxxx */
+#define OVER3  0x04 /* 11100000 100xxxxx */
+#define LARGE  0x08 /* 11110100 1001xxxx, 11110100 101xxxxx, 11110101+ 10xxxxxx */
+#define SURR   0x10 /* 11101101 101xxxxx */
+#define OVER2  0x20 /* 1100000x 10xxxxxx */
+#define OVER4  0x40 /* 11110000 1000xxxx, 11110101+ 1000xxxx */
+#define CONTS  0x80 /* 10xxxxxx 10xxxxxx */
+#define CARRY  (SHORT | LONG | CONTS) /* whatever the first byte's low nibble */
+
+static const unsigned char vhi1[16] = { /* by the first byte's high nibble */
+	LONG, LONG, LONG, LONG, LONG, LONG, LONG, LONG,
+	CONTS, CONTS, CONTS, CONTS,
+	SHORT | OVER2, SHORT, SHORT | OVER3 | SURR, SHORT | LARGE | OVER4,
+};
+static const unsigned char vlo1[16] = { /* by the first byte's low nibble */
+	CARRY | OVER2 | OVER3 | OVER4, CARRY | OVER2, CARRY, CARRY,
+	CARRY | LARGE, CARRY | LARGE | OVER4, CARRY | LARGE | OVER4, CARRY | LARGE | OVER4,
+	CARRY | LARGE | OVER4, CARRY | LARGE | OVER4, CARRY | LARGE | OVER4, CARRY | LARGE | OVER4,
+	CARRY | LARGE | OVER4, CARRY | LARGE | OVER4 | SURR, CARRY | LARGE | OVER4, CARRY | LARGE | OVER4,
+};
+static const unsigned char vhi2[16] = { /* by the second byte's high nibble */
+	SHORT, SHORT, SHORT, SHORT, SHORT, SHORT, SHORT, SHORT,
+	LONG | OVER2 | CONTS | OVER3 | OVER4,
+	LONG | OVER2 | CONTS | OVER3 | LARGE,
+	LONG | OVER2 | CONTS | SURR | LARGE,
+	LONG | OVER2 | CONTS | SURR | LARGE,
+	SHORT, SHORT, SHORT, SHORT,
+};
+
+#undef SHORT
+#undef LONG
+#undef OVER3
+#undef LARGE
+#undef SURR
+#undef OVER2
+#undef OVER4
+#undef CONTS
+#undef CARRY
+#endif
+
+static size_t
+validblock(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	__m256i hi1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)vhi1));
+	__m256i lo1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)vlo1));
+	__m256i hi2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)vhi2));
+	__m256i nib = _mm256_set1_epi8(0x0F), err = _mm256_setzero_si256();
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i p1 = _mm256_loadu_si256((const __m256i *)(p + i - 1));
+		__m256i p2 = _mm256_loadu_si256((const __m256i *)(p + i - 2));
+		__m256i p3 = _mm256_loadu_si256((const __m256i *)(p + i - 3));
+		__m256i e = _mm256_and_si256(
+			_mm256_and_si256(
+				_mm256_shuffle_epi8(hi1, _mm256_and_si256(_mm256_srli_epi16(p1, 4), nib)),
+				_mm256_shuffle_epi8(lo1, _mm256_and_si256(p1, nib))),
+			_mm256_shuffle_epi8(hi2, _mm256_and_si256(_mm256_srli_epi16(v, 4), nib)));
+		__m256i must = _mm256_or_si256(_mm256_subs_epu8(p2, _mm256_set1_epi8((char)(0340 - 0200))),
+		                               _mm256_subs_epu8(p3, _mm256_set1_epi8((char)(0360 - 0200))));
 
-		foreach1(set->blk[c], n, r, fcn);
+		e = _mm256_xor_si256(e, _mm256_and_si256(must, _mm256_set1_epi8((char)0200)));
+		err = _mm256_or_si256(err, e);
 	}
+	if (!_mm256_testz_si256(err, err)) {
+		return 0;
+	}
+#elif defined(__SSSE3__)
+	__m128i hi1 = _mm_loadu_si128((const __m128i *)vhi1);
+	__m128i lo1 = _mm_loadu_si128((const __m128i *)vlo1);
+	__m128i hi2 = _mm_loadu_si128((const __m128i *)vhi2);
+	__m128i nib = _mm_set1_epi8(0x0F), err = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(p + i - 1));
+		__m128i p2 = _mm_loadu_si128((const __m128i *)(p + i - 2));
+		__m128i p3 = _mm_loadu_si128((const __m128i *)(p + i - 3));
+		__m128i e = _mm_and_si128(
+			_mm_and_si128(
+				_mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(p1, 4), nib)),
+				_mm_shuffle_epi8(lo1, _mm_and_si128(p1, nib))),
+			_mm_shuffle_epi8(hi2, _mm_and_si128(_mm_srli_epi16(v, 4), nib)));
+		__m128i must = _mm_or_si128(_mm_subs_epu8(p2, _mm_set1_epi8((char)(0340 - 0200))),
+		                            _mm_subs_epu8(p3, _mm_set1_epi8((char)(0360 - 0200))));
+
+		e = _mm_xor_si128(e, _mm_and_si128(must, _mm_set1_epi8((char)0200)));
+		err = _mm_or_si128(err, e);
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xFFFF) {
+		return 0;
+	}
+#else
+	(void)p;
+	(void)len;
+#endif
+	return i;
 }
 
 /*
- * foreach1() is the recursive workhorse used by foreach(). Whereas foreach()
- * applies to a UTFSet, foreach1() applies to an individual node in the tree.
- * As well as the node, which may be either a pointer or a bitmask, foreach1()
- * is passed: the number of bytes still to go, the value of the rune extracted
- * from bytes so far, and the function to be called for each rune in the set.
+ * These tables say, for each leading byte 11xxxxxx, what the bytes following it
+ * must look like in well-formed UTF-8. Taking the leading byte and the three
+ * after it as a little-endian word w, they are well-formed if w & vmask[] is
+ * vwant[]: every continuation byte must be 10xxxxxx, and the first of them is
+ * held to the narrower ranges of Table 3-7 of the Unicode Standard, which rule
+ * out overlong sequences (after 11100000), UTF-16 surrogates (after 11101101)
+ * and runes beyond U+10FFFF (after 11110100). The one range that no mask can
+ * express is that after 11110000, which must be at least 10010000 to not be
+ * overlong, so that is checked separately. Leading bytes that may not appear
+ * at all, 11000000 and 11000001 among them, can never match, so in particular
+ * the final four values of clo6[] are never used to descend.
  */
-void
-foreach1(union child t, unsigned int n, char32_t r, void (*fcn)(char32_t))
+#define V2 UINT32_C(0x0000C000)
+#define V3 UINT32_C(0x00C0C000)
+#define V4 UINT32_C(0xC0C0C000)
+#define NO UINT32_C(0)
+#define W2 UINT32_C(0x00008000)
+#define W3 UINT32_C(0x00808000)
+#define W4 UINT32_C(0x80808000)
+
+static const uint32_t vmask[] = {
+	NO, NO, V2, V2, V2, V2, V2, V2, /* 000xxx */
+	V2, V2, V2, V2, V2, V2, V2, V2, /* 001xxx */
+	V2, V2, V2, V2, V2, V2, V2, V2, /* 010xxx */
+	V2, V2, V2, V2, V2, V2, V2, V2, /* 011xxx */
+	V3 | 0x2000, V3, V3, V3, V3, V3, V3, V3, /* 100xxx */
+	V3, V3, V3, V3, V3, V3 | 0x2000, V3, V3, /* 101xxx */
+	V4, V4, V4, V4, V4 | 0x3000, NO, NO, NO, /* 110xxx */
+	NO, NO, NO, NO, NO, NO, NO, NO, /* 111xxx */
+};
+static const uint32_t vwant[] = {
+	 1,  1, W2, W2, W2, W2, W2, W2, /* 000xxx */
+	W2, W2, W2, W2, W2, W2, W2, W2, /* 001xxx */
+	W2, W2, W2, W2, W2, W2, W2, W2, /* 010xxx */
+	W2, W2, W2, W2, W2, W2, W2, W2, /* 011xxx */
+	W3 | 0x2000, W3, W3, W3, W3, W3, W3, W3, /* 100xxx */
+	W3, W3, W3, W3, W3, W3, W3, W3, /* 101xxx */
+	W4, W4, W4, W4, W4,  1,  1,  1, /* 110xxx */
+	 1,  1,  1,  1,  1,  1,  1,  1, /* 111xxx */
+};
+
+#undef V2
+#undef V3
+#undef V4
+#undef NO
+#undef W2
+#undef W3
+#undef W4
+
+static const char *
+addutfs1(UTFSet *set, const char *s, size_t len, bool check)
 {
-	if (n == 0) {
-		/*
-		 * This is the final byte, so this node's children are booleans,
-		 * which means this is a bitmask. Call the function for each set
-		 * bit, again appending the value onto that of the rune so far.
-		 */
-		for (unsigned char c = 0; c < 64; c++) {
-			if ((t.bits & (UINT64_C(1) << c))) {
-				fcn((r * 64) | c);
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + len;
+	const unsigned char *stop = check ? p : end;
+	const unsigned char *vfrom = len > 3 ? p + 3 : end;
+	bool word = check;
+	union child *tp;
+
+	for (;;) {
+		if (p >= stop) {
+			/*
+			 * When checking, we stop here at the start of each rune
+			 * that validblock() hasn't passed, so that checking costs
+			 * the runes it has passed nothing more than the test for
+			 * the end of the string they need anyway. Where it can't
+			 * help, as it can't without the three bytes before, or
+			 * a whole vector after, or once it has found an error
+			 * somewhere ahead, we check each rune by itself, below.
+			 */
+			size_t n;
+
+			if (p >= end) {
+				break;
+			} else if (p < vfrom) {
+				stop = p + 1;
+			} else if ((n = validblock(p, end - p < VBLOCK ? end - p : VBLOCK)) > 0) {
+				stop = p + n - 3;
+				word = false;
+			} else {
+				stop = end;
+				word = true;
 			}
 		}
-	} else if (t.ptr) {
+
+		unsigned char c = *p;
+
+		if (c < 0200) {
+			/*
+			 * ASCII bytes need no descent at all, as they only ever
+			 * set bits in the first two bitmasks; see addutf(). So
+			 * we gather a whole run of them into two local masks,
+			 * without any branches, and then set them all at once.
+			 */
+			size_t n = asciilen(p, end - p);
+			uint64_t m0 = 0, m1 = 0;
+
+			for (size_t i = 0; i < n; i++) {
+				uint64_t bit = UINT64_C(1) << (p[i] % 64);
+				uint64_t hi = -(uint64_t)(p[i] / 64);
+
+				m0 |= bit & ~hi;
+				m1 |= bit & hi;
+			}
+			set->blk[0].bits |= m0;
+			set->blk[1].bits |= m1;
+			p += n;
+			continue;
+		} else if (c < 0300) {
+			break; /* continuation byte */
+		}
+
+		unsigned int n = clo6[c % 64];
+		const unsigned char *q = p;
+
+		if ((size_t)(end - p) < n + 2) {
+			break; /* cut short */
+		}
+		if (word) {
+			/*
+			 * We check every byte before we descend at all, so the
+			 * tree never gains blocks for an ill-formed sequence,
+			 * and we check them all at once, as a word, rather than
+			 * branch on each byte, which would mispredict on text
+			 * of mixed lengths. Only near the end of the string are
+			 * there too few bytes left to take a whole word.
+			 */
+			uint32_t w;
+
+			if (end - p >= 4) {
+				w = p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+			} else {
+				w = p[0] | p[1] << 8 | (uint32_t)(end - p == 3 ? p[2] : 0) << 16;
+			}
+			if (((w & vmask[c % 64]) ^ vwant[c % 64]) | ((c == 0360) & (p[1] < 0220))) {
+				break; /* ill-formed */
+			}
+		}
+
 		/*
-		 * This is not the final byte, so this node's children (if it
-		 * has any) are also nodes. Recurse over them for each possible
-		 * continuation value (10xxxxxx). We append the byte's value
-		 * onto that of the rune so far.
+		 * We could simply add n + 2 to p, to get to the next rune, but
+		 * then where each rune starts would depend on the loads for the
+		 * rune before, and so the processor would have to wait for them
+		 * before going any further. Instead we branch on the length of
+		 * the rune, which the processor can predict and race ahead of.
+		 * This is a bigger win than it might seem: the blocks are few
+		 * enough to stay in cache, so walking down the tree is cheap,
+		 * so long as it can overlap with the walk for the next rune.
 		 */
-		for (unsigned char c = 0; c < 64; c++) {
-			foreach1(t.ptr->blk[c], n - 1, (r * 64) | c, fcn);
+		tp = &set->blk[c % 64];
+		switch (n) {
+		case 2:
+			/*
+			 * Beneath full[1] is full[0], which we look out for
+			 * below, so that we never write to either.
+			 */
+			if (!tp->ptr && !(tp->ptr = newblock(set->pool))) {
+				return (const char *)p; /* out of memory */
+			}
+			tp = &tp->ptr->blk[*++q % 64];
+			/* fallthrough */
+		case 1:
+			if (!tp->ptr && !(tp->ptr = newblock(set->pool))) {
+				return (const char *)p; /* out of memory */
+			} else if (tp->ptr == &full[0]) {
+				p = q + 3; /* already in the set */
+				break;
+			}
+			tp = &tp->ptr->blk[*++q % 64];
+			/* fallthrough */
+		case 0:
+			tp->bits |= UINT64_C(1) << (*++q % 64);
+			p = q + 1;
+			break;
+		default:
+			/*
+			 * Only leading bytes forbidden by RFC 3629 have so
+			 * many continuation bytes, so we leave them to addutf().
+			 */
+			if (!(q = (const unsigned char *)addutf(set, (const char *)p))) {
+				return (const char *)p; /* out of memory */
+			}
+			p = q;
 		}
 	}
+
+	return (const char *)p;
 }
 
 /*
- * The following are examples of how this data structure is to be used.
+ * A UTFSetStream adds runes to a set from a string that arrives in chunks, as
+ * from read(), where a rune may well be split between one chunk and the next.
+ * Each chunk goes straight to addutfs(), or addvalidutfs() if check is set,
+ * and only a rune cut short at the end of a chunk is copied, into buf, to be
+ * finished off by the start of the next. We could instead keep the child that
+ * addutf() had got down to, and carry on from there, but then we would have
+ * allocated blocks for a rune that might never arrive, and in any case a rune
+ * is at most eight bytes, so the copy costs next to nothing.
  */
-#include <inttypes.h>
-#include <stdio.h>
+typedef struct utfsetstream {
+	UTFSet *set;
+	bool check;
+	unsigned char len;  /* bytes in buf */
+	char buf[8];        /* the rune cut short so far */
+} UTFSetStream;
 
 /*
- * prune() is an example function for passing to foreach(). It prints the rune
- * it is passed, in the usual U+0000 format, to stdout.
+ * utfset_stream_init() starts a stream adding runes to the set.
  */
 void
-prune(char32_t r)
+utfset_stream_init(UTFSetStream *st, UTFSet *set, bool check)
 {
-	printf("U+%04" PRIX32 "\n", (uint32_t)r);
+	st->set = set;
+	st->check = check;
+	st->len = 0;
 }
 
 /*
- * prunes() is an example function which, given a UTF-8 string, will print the
- * runes it contains in ascending order. Returns 0 on success, -1 on failure.
+ * utfset_stream_feed() adds the runes in the next len bytes of the string. It
+ * returns 0 on success, or -1 if the string is not UTF-8 (or, when checking,
+ * is ill-formed), or if we run out of memory, after which the stream should
+ * be given up on.
  */
 int
-prunes(const char *s)
+utfset_stream_feed(UTFSetStream *st, const char *s, size_t len)
 {
-	UTFSet set = { 0 }; /* empty set */
+	const char *end = s + len, *p;
+
+	if (st->len > 0) {
+		size_t need = clo6[(unsigned char)st->buf[0] % 64] + 2;
+		size_t k = need - st->len < len ? need - st->len : len;
+
+		memcpy(st->buf + st->len, s, k);
+		st->len += k;
+		s += k;
+		if (st->len < need) {
+			return 0; /* still cut short */
+		}
+		st->len = 0;
+		if (addutfs1(st->set, st->buf, need, st->check) != st->buf + need) {
+			return -1;
+		}
+	}
+
+	p = addutfs1(st->set, s, end - s, st->check);
+	if (p < end && (unsigned char)*p >= 0300 &&
+	    (size_t)(end - p) < (size_t)clo6[(unsigned char)*p % 64] + 2) {
+		memcpy(st->buf, p, end - p);
+		st->len = end - p;
+		return 0;
+	}
+	return p == end ? 0 : -1;
+}
+
+/*
+ * utfset_stream_finish() ends the stream, returning 0 if the string ended on a
+ * rune boundary, or -1 if its last rune was cut short, and so never added.
+ */
+int
+utfset_stream_finish(UTFSetStream *st)
+{
+	int ret = st->len > 0 ? -1 : 0;
+
+	st->len = 0;
+	return ret;
+}
+
+/*
+ * bmplen() is like asciilen(), but for UTF-16: it returns the number of code
+ * units at the start of the string, up to len, that are not surrogates, that
+ * is, not of the form 11011xxxxxxxxxxx, and so are each a rune by themselves.
+ * Without any SIMD we check four code units at a time in a 64-bit word, using
+ * the usual trick for spotting a zero among them once the surrogates have been
+ * turned into zeros.
+ */
+static size_t
+bmplen(const char16_t *p, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 16 <= len; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		v = _mm256_and_si256(v, _mm256_set1_epi16((short)0xF800));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_set1_epi16((short)0xD800))) != 0) {
+			break;
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 8 <= len; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		v = _mm_and_si128(v, _mm_set1_epi16((short)0xF800));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_set1_epi16((short)0xD800))) != 0) {
+			break;
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 8 <= len; i += 8) {
+		uint16x8_t v = vandq_u16(vld1q_u16((const uint16_t *)(p + i)), vdupq_n_u16(0xF800));
+		if (vmaxvq_u16(vceqq_u16(v, vdupq_n_u16(0xD800))) != 0) {
+			break;
+		}
+	}
+#else
+	for (; i + 4 <= len; i += 4) {
+		uint64_t w = (uint64_t)p[i] | (uint64_t)p[i + 1] << 16 |
+		             (uint64_t)p[i + 2] << 32 | (uint64_t)p[i + 3] << 48;
+		w = (w & UINT64_C(0xF800F800F800F800)) ^ UINT64_C(0xD800D800D800D800);
+		if ((w - UINT64_C(0x0001000100010001)) & ~w & UINT64_C(0x8000800080008000)) {
+			break;
+		}
+	}
+#endif
+	while (i < len && (p[i] & 0xF800) != 0xD800) {
+		i++;
+	}
+	return i;
+}
 
-	while (*s != '\0') {
-		if (!(s = addutf(&set, s))) {
-			return -1; /* something went wrong */
+/*
+ * addutf16() adds every rune in the first len code units of the UTF-16 string
+ * to the UTFSet, just as addutfs() does for UTF-8, and returns a pointer to the
+ * code unit following the last rune added. If that is not s + len then the rune
+ * there could not be added: it is an unpaired surrogate, it is cut short by the
+ * end of the string, or we ran out of memory.
+ *
+ * Most UTF-16 text has no surrogates at all, so we find whole runs without any
+ * and add their runes with the descent unrolled: below U+0800 a rune sets a bit
+ * in the root, and otherwise in a block just beneath it. ASCII is gathered into
+ * two local masks, as in addutfs(). Surrogate pairs are decoded and left to
+ * addrune().
+ */
+const char16_t *
+addutf16(UTFSet *set, const char16_t *s, size_t len)
+{
+	const char16_t *end = s + len;
+	union child *tp;
+
+	while (s < end) {
+		size_t n = bmplen(s, end - s);
+		uint64_t m0 = 0, m1 = 0;
+
+		for (size_t i = 0; i < n; i++) {
+			char32_t r = s[i];
+
+			if (r < 0x80) {
+				uint64_t hi = -(uint64_t)(r / 64); /* see addutfs1() */
+
+				m0 |= (UINT64_C(1) << (r % 64)) & ~hi;
+				m1 |= (UINT64_C(1) << (r % 64)) & hi;
+				continue;
+			} else if (r < 0x800) {
+				tp = &set->blk[r >> 6];
+			} else {
+				tp = &set->blk[32 + (r >> 12)];
+				if (!tp->ptr && !(tp->ptr = newblock(set->pool))) {
+					set->blk[0].bits |= m0;
+					set->blk[1].bits |= m1;
+					return s + i; /* out of memory */
+				} else if (tp->ptr == &full[0]) {
+					continue; /* already in the set */
+				}
+				tp = &tp->ptr->blk[(r >> 6) % 64];
+			}
+			tp->bits |= UINT64_C(1) << (r % 64);
+		}
+		set->blk[0].bits |= m0;
+		set->blk[1].bits |= m1;
+		s += n;
+
+		/*
+		 * Then come surrogates, often several pairs of them at a time.
+		 * Each must be a high one, 110110xxxxxxxxxx, followed by a low
+		 * one, 110111xxxxxxxxxx, which between them hold the rune less
+		 * 0x10000.
+		 */
+		while (s < end && (s[0] & 0xF800) == 0xD800) {
+			if (s[0] >= 0xDC00 || end - s < 2 || (s[1] & 0xFC00) != 0xDC00) {
+				return s; /* unpaired */
+			}
+			if (addrune(set, 0x10000 + ((char32_t)(s[0] - 0xD800) << 10) + (s[1] - 0xDC00)) < 0) {
+				return s; /* out of memory */
+			}
+			s += 2;
 		}
 	}
 
+	return s;
+}
+
+/*
+ * hasutf() tests whether the next rune in the UTF-8 string is in the UTFSet,
+ * storing the answer in *in, and returns a pointer to the byte following that
+ * rune. It walks exactly the same path through the tree as addutf() would, so
+ * a lookup costs at most one load per byte, but it never allocates: if it runs
+ * into a child that doesn't point anywhere, the rune cannot be in the set.
+ */
+const char *
+hasutf(const UTFSet *set, const char *s, bool *in)
+{
+	const union child *tp;
+	unsigned char c = *s++;
+
+	if (c >= 0300) {
+		tp = &set->blk[c % 64];
+		for (unsigned int n = clo6[c % 64]; c = *s++, n > 0; n--) {
+			if (!tp->ptr) {
+				/*
+				 * There are n bytes of this rune still to go,
+				 * but we needn't read them to know the answer.
+				 */
+				*in = false;
+				return s + n;
+			}
+			tp = &tp->ptr->blk[c % 64];
+		}
+	} else if (c < 0200) {
+		tp = &set->blk[c / 64]; /* see addutf() */
+	} else {
+		return NULL; /* not the start of a rune */
+	}
+
+	*in = (tp->bits & (UINT64_C(1) << (c % 64))) != 0;
+
+	return s;
+}
+
+/*
+ * runeutf() writes the UTF-8 encoding of a rune into buf, which must have room
+ * for four bytes, and returns its length, or 0 if the rune is beyond U+10FFFF.
+ */
+size_t
+runeutf(char *buf, char32_t r)
+{
+	if (r < 0x80) {
+		buf[0] = r;
+	} else if (r < 0x800) {
+		buf[0] = 0300 | (r >> 6);
+		buf[1] = 0200 | (r % 64);
+	} else if (r < 0x10000) {
+		buf[0] = 0340 | (r >> 12);
+		buf[1] = 0200 | ((r >> 6) % 64);
+		buf[2] = 0200 | (r % 64);
+	} else if (r < 0x110000) {
+		buf[0] = 0360 | (r >> 18);
+		buf[1] = 0200 | ((r >> 12) % 64);
+		buf[2] = 0200 | ((r >> 6) % 64);
+		buf[3] = 0200 | (r % 64);
+	} else {
+		return 0;
+	}
+	return r < 0x80 ? 1 : r < 0x800 ? 2 : r < 0x10000 ? 3 : 4;
+}
+
+/*
+ * hasrune() is like hasutf(), but takes the rune itself rather than its UTF-8
+ * encoding, and finds its path through the tree just as addrune() does. Runes
+ * beyond U+10FFFF are never in the set.
+ */
+bool
+hasrune(const UTFSet *set, char32_t r)
+{
+	const union child *tp;
+	unsigned int n;
+
+	if (r >= 0x110000) {
+		return false;
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	tp = &set->blk[64 - (64 >> n) + (r >> 6 * (n + 1))];
+	for (; n > 0; n--) {
+		if (!tp->ptr) {
+			return false;
+		}
+		tp = &tp->ptr->blk[(r >> 6 * n) % 64];
+	}
+	return (tp->bits & (UINT64_C(1) << (r % 64))) != 0;
+}
+
+/*
+ * Each step hasrune() takes down the tree depends on the load before it, so
+ * once a set is too big for the cache, every lookup is a chain of cache misses
+ * one after the other. hasrunes() looks up n runes at once, storing 1 or 0 in
+ * out[i] as in[i] is in the set or not. It takes them BATCH at a time, and for
+ * each of those, one step down the tree at a time: having found the child for
+ * every rune in the batch, it asks the processor to begin fetching them all,
+ * with prefetch(), and only on the next step does it read from any of them,
+ * by which time they should mostly have arrived. So rather than wait for each
+ * miss in turn, we wait for a batch's worth of misses at once.
+ */
+#define BATCH 16
+
+#if defined(__GNUC__)
+#define prefetch(p) __builtin_prefetch(p)
+#else
+#define prefetch(p) ((void)(p))
+#endif
+
+/*
+ * pick() returns a if the mask m is all ones, or b if it is all zeros. The
+ * point of doing it with masks is that there is no branch to mispredict.
+ */
+static inline uint64_t
+pick(uint64_t m, uint64_t a, uint64_t b)
+{
+	return (a & m) | (b & ~m);
+}
+
+void
+hasrunes(const UTFSet *set, const char32_t *in, size_t n, uint8_t *out)
+{
+	const union child *tp[BATCH];
+	unsigned int left[BATCH];
+
+	for (size_t i = 0; i < n; i += BATCH) {
+		size_t k = n - i < BATCH ? n - i : BATCH;
+		const char32_t *r = in + i;
+		unsigned int more = 0;
+
+		/*
+		 * Runes beyond U+1FFFFF have no path, and those beyond U+10FFFF
+		 * aren't in the set, so we send all of them down some path or
+		 * other, and only ignore the answer at the end.
+		 */
+		for (size_t j = 0; j < k; j++) {
+			char32_t x = r[j] % 0x200000;
+
+			left[j] = (x >= 0x800) + (x >= 0x10000);
+			tp[j] = &set->blk[64 - (64 >> left[j]) + (x >> 6 * (left[j] + 1))];
+			more |= left[j];
+		}
+
+		/*
+		 * Which runes still have steps to go is as unpredictable as
+		 * their lengths, so rather than branch on it, every rune takes
+		 * the step, and those with none to go simply stay where they
+		 * are. Those that run out of tree go on down through none.
+		 */
+		while (more) {
+			more = 0;
+			for (size_t j = 0; j < k; j++) {
+				uint64_t go = -(uint64_t)(left[j] > 0);
+				uint64_t b = (uintptr_t)tp[j]->ptr;
+				const struct block *p;
+
+				p = (const struct block *)(uintptr_t)pick(-(uint64_t)(b != 0) & go, b, (uintptr_t)&none);
+				tp[j] = (const union child *)(uintptr_t)pick(go, (uintptr_t)&p->blk[(r[j] >> 6 * left[j]) % 64], (uintptr_t)tp[j]);
+				prefetch(tp[j]);
+				more |= left[j] -= go & 1;
+			}
+		}
+		for (size_t j = 0; j < k; j++) {
+			out[i + j] = (tp[j]->bits >> (r[j] % 64) & 1) & (r[j] < 0x110000);
+		}
+	}
+}
+
+#if defined(__GNUC__)
+/*
+ * addutf_atomic() is like addutf(), except that any number of threads may call
+ * it on the same set at once, without a lock. Where a child doesn't point
+ * anywhere yet, each thread that finds it so allocates a block and tries to
+ * install it with a compare-and-swap, and only one can succeed; the others
+ * free theirs and carry on down the winner's. The final bit is set with an
+ * atomic or, so that no thread's bit can be lost. addrune_atomic() is the same
+ * for a rune, which for simplicity we encode first.
+ *
+ * Nothing else may be done with the set while this goes on, not even lookups,
+ * and the set must not use a pool, as pools are not safe to share between
+ * threads; for such a set these simply return NULL or -1. This uses the atomic
+ * builtins of GCC and Clang, since the tree is not made of C11 atomic types.
+ */
+const char *
+addutf_atomic(UTFSet *set, const char *s)
+{
+	union child *tp;
+	struct block *b, *nb;
+	unsigned char c = *s++;
+
+	if (set->pool) {
+		return NULL; /* not thread-safe */
+	}
+	if (c >= 0300) {
+		tp = &set->blk[c % 64];
+		for (unsigned int n = clo6[c % 64]; c = *s++, n > 0; n--) {
+			if (!(b = __atomic_load_n(&tp->ptr, __ATOMIC_ACQUIRE))) {
+				if (!(nb = newblock(NULL))) {
+					return NULL; /* out of memory */
+				}
+				if (__atomic_compare_exchange_n(&tp->ptr, &b, nb, false,
+				                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					b = nb;
+				} else {
+					free(nb); /* another thread got there first */
+				}
+			}
+			if (b == &full[n - 1]) {
+				return s + n;
+			}
+			tp = &b->blk[c % 64];
+		}
+	} else if (c < 0200) {
+		tp = &set->blk[c / 64]; /* see addutf() */
+	} else {
+		return NULL; /* not the start of a rune */
+	}
+
+	__atomic_fetch_or(&tp->bits, UINT64_C(1) << (c % 64), __ATOMIC_RELAXED);
+
+	return s;
+}
+
+int
+addrune_atomic(UTFSet *set, char32_t r)
+{
+	char buf[4];
+
+	return runeutf(buf, r) && addutf_atomic(set, buf) ? 0 : -1;
+}
+#endif
+
+/*
+ * utfset_span() returns the length in bytes of the longest prefix of the first
+ * len bytes of the UTF-8 string whose runes are all in the UTFSet, much like
+ * strspn(), and utfset_cspan() of the longest whose runes are all not in it,
+ * like strcspn(). Both stop short at anything that is not the start of a whole
+ * rune, that is, a continuation byte, or a rune cut short by the end of the
+ * string, since whether that is in the set or not has no meaning.
+ *
+ * Doing this a rune at a time with hasutf() would be simple enough, but we can
+ * do rather better. Both are implemented by span1(), whose in argument says
+ * whether we are looking for runes in the set or not.
+ */
+static size_t span1(const UTFSet *, const char *, size_t, bool);
+
+size_t
+utfset_span(const UTFSet *set, const char *s, size_t len)
+{
+	return span1(set, s, len, true);
+}
+
+size_t
+utfset_cspan(const UTFSet *set, const char *s, size_t len)
+{
+	return span1(set, s, len, false);
+}
+
+/*
+ * asciispan() returns the number of ASCII bytes at the start of the string, up
+ * to len, that are in the set if in is true, or not in it otherwise.
+ *
+ * With SSSE3 or NEON we can test sixteen bytes at a time, using a table lookup
+ * instruction (pshufb or tbl) which picks a byte from a 16-byte table for each
+ * byte's low nibble. So we build a table whose byte for each low nibble has a
+ * bit set for each high nibble which, together with it, makes an ASCII byte in
+ * the set, and then pick out the bit for the byte's high nibble with a second
+ * lookup, from a table whose entries for the high nibbles of non-ASCII bytes
+ * are 0. Building the first table takes a moment, so span1() does so only once
+ * for each string, and only if it is long enough; otherwise nib is NULL.
+ */
+#if defined(__SSSE3__) || (defined(__ARM_NEON) && defined(__aarch64__))
+#define NIBBLES
+#endif
+
+static size_t
+asciispan(const UTFSet *set, const unsigned char *p, size_t len, bool in, const unsigned char *nib)
+{
+	uint64_t m0 = set->blk[0].bits, m1 = set->blk[1].bits;
+	size_t i = 0;
+
+#if !defined(NIBBLES)
+	(void)nib;
+#else
+	if (nib) {
+#if defined(__SSSE3__)
+		__m128i tbl = _mm_loadu_si128((const __m128i *)nib);
+		__m128i sel = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+		                            0, 0, 0, 0, 0, 0, 0, 0);
+		__m128i lo = _mm_set1_epi8(0x0F);
+
+		for (; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+			__m128i t = _mm_shuffle_epi8(tbl, _mm_and_si128(v, lo));
+			__m128i b = _mm_shuffle_epi8(sel, _mm_and_si128(_mm_srli_epi16(v, 4), lo));
+			unsigned int out = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(t, b), _mm_setzero_si128()));
+			unsigned int stop = in ? out : (~out & 0xFFFF) | _mm_movemask_epi8(v);
+
+			if (stop != 0) {
+				return i + ctz64(stop);
+			}
+		}
+#else
+		uint8x16_t tbl = vld1q_u8(nib);
+		static const unsigned char bit[16] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+		uint8x16_t sel = vld1q_u8(bit);
+
+		for (; i + 16 <= len; i += 16) {
+			uint8x16_t v = vld1q_u8(p + i);
+			uint8x16_t t = vqtbl1q_u8(tbl, vandq_u8(v, vdupq_n_u8(0x0F)));
+			uint8x16_t b = vqtbl1q_u8(sel, vshrq_n_u8(v, 4));
+			uint8x16_t stop = vtstq_u8(t, b); /* in the set */
+
+			stop = in ? vmvnq_u8(stop) : vorrq_u8(stop, vcgeq_u8(v, vdupq_n_u8(0200)));
+			/*
+			 * There is no movemask on NEON, but narrowing each
+			 * 16-bit lane by 4 bits leaves 4 bits for each byte.
+			 */
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(stop), 4)), 0);
+
+			if (mask != 0) {
+				return i + ctz64(mask) / 4;
+			}
+		}
+#endif
+	}
+#endif
+	for (; i < len && p[i] < 0200; i++) {
+		if ((((p[i] < 64 ? m0 : m1) >> (p[i] % 64)) & 1) != in) {
+			break;
+		}
+	}
+	return i;
+}
+
+static size_t
+span1(const UTFSet *set, const char *s, size_t len, bool in)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + len;
+	const unsigned char *q;
+	const unsigned char *nib = NULL;
+	const union child *tp;
+	bool bit;
+
+#if defined(NIBBLES)
+	unsigned char tbl[16] = { 0 };
+
+	if (len >= 32) {
+		for (uint64_t x = set->blk[0].bits; x; x &= x - 1) {
+			unsigned int c = ctz64(x);
+			tbl[c % 16] |= 1 << (c / 16);
+		}
+		for (uint64_t x = set->blk[1].bits; x; x &= x - 1) {
+			unsigned int c = 64 + ctz64(x);
+			tbl[c % 16] |= 1 << (c / 16);
+		}
+		nib = tbl;
+	}
+#endif
+
+	while (p < end) {
+		unsigned char c = *p;
+
+		if (c < 0200) {
+			p += asciispan(set, p, end - p, in, nib);
+			if (p < end && *p < 0200) {
+				break; /* an ASCII byte we are not looking for */
+			}
+			continue;
+		} else if (c < 0300) {
+			break; /* continuation byte */
+		}
+
+		unsigned int n = clo6[c % 64];
+
+		if ((size_t)(end - p) < n + 2) {
+			break; /* cut short */
+		}
+
+		/*
+		 * As in addutfs1(), we branch on the length of the rune, so as
+		 * not to make where the next rune starts wait on any loads.
+		 * Since the blocks for a run of nearby runes are the same, they
+		 * will all be in the cache, so there is no need to remember the
+		 * last block we visited: walking down to it again is cheap.
+		 */
+		tp = &set->blk[c % 64];
+		q = p;
+		switch (n) {
+		case 2:
+			tp = &(tp->ptr ? tp->ptr : &none)->blk[*++q % 64];
+			/* fallthrough */
+		case 1:
+			tp = &(tp->ptr ? tp->ptr : &none)->blk[*++q % 64];
+			/* fallthrough */
+		case 0:
+			bit = (tp->bits >> (*++q % 64)) & 1;
+			q++;
+			break;
+		default:
+			q = (const unsigned char *)hasutf(set, (const char *)p, &bit);
+		}
+		if (bit != in) {
+			break;
+		}
+		p = q;
+	}
+
+	return (const char *)p - s;
+}
+
+/*
+ * A UTFSetIter walks through the runes in a set one at a time, in ascending
+ * order, as foreach() does, but without any recursion or callbacks, so that
+ * the caller can write the body of the loop inline and stop whenever it likes:
+ *
+ *	UTFSetIter it;
+ *	char32_t r;
+ *
+ *	utfset_iter_init(&it, set);
+ *	while (utfset_iter_next(&it, &r)) {
+ *		...
+ *	}
+ *
+ * In place of recursion it keeps an explicit stack of the blocks it is partway
+ * through, one per continuation byte still to go, of which there are at most
+ * six (after the invalid leading byte 11111111). Each entry on the stack holds
+ * the block, the number of bytes still to go after its children, the value of
+ * the rune extracted from the bytes that led to the block, and an occupancy
+ * mask with a bit set for each occupied child that is not yet visited.
+ * The same goes for the root, except that it is always there. Likewise, the
+ * bitmask it is partway through, if any, has its bits cleared as their runes
+ * are returned. That way we can always go straight to the next nonempty child
+ * or set bit by counting trailing zeros, and the time it takes to iterate is
+ * proportional to the size of the set, not the capacity of its blocks.
+ *
+ * The set must not be changed while it is being iterated over.
+ */
+typedef struct utfsetiter {
+	const UTFSet *set;
+	uint64_t root;       /* root children still to visit */
+	unsigned int depth;  /* number of blocks on the stack */
+	struct {
+		const struct block *b;
+		uint64_t occ;
+		unsigned int n;
+		char32_t r;
+	} stk[6];
+	uint64_t bits;       /* bitmask we are partway through */
+	char32_t r;          /* rune so far, for that bitmask */
+} UTFSetIter;
+
+/*
+ * occupied() says whether a child, with n bytes still to go after it, has any
+ * runes beneath it: either it is a nonzero bitmask or it points somewhere.
+ */
+static inline bool
+occupied(union child t, unsigned int n)
+{
+	return n == 0 ? t.bits != 0 : t.ptr != NULL;
+}
+
+/*
+ * occupancy() returns a mask with a bit set for each occupied child of the
+ * block, given the number of bytes still to go after those children.
+ */
+static uint64_t
+occupancy(const struct block *b, unsigned int n)
+{
+	uint64_t occ = 0;
+
+	for (unsigned int i = 0; i < 64; i++) {
+		occ |= (uint64_t)occupied(b->blk[i], n) << i;
+	}
+	return occ;
+}
+
+/*
+ * utfset_iter_init() sets the iterator to the start of the set.
+ */
+void
+utfset_iter_init(UTFSetIter *it, const UTFSet *set)
+{
+	it->set = set;
+	it->root = 0;
+	it->depth = 0;
+	it->bits = 0;
+
+	for (unsigned int c = 0; c < 64; c++) {
+		it->root |= (uint64_t)occupied(set->blk[c], clo6[c]) << c;
+	}
+}
+
+/*
+ * utfset_iter_next() stores the next rune of the set in *r and returns true,
+ * or returns false if there are no more.
+ */
+bool
+utfset_iter_next(UTFSetIter *it, char32_t *r)
+{
+	union child t;
+	unsigned int c, n;
+	char32_t v;
+
+	for (;;) {
+		if (it->bits) {
+			/*
+			 * Take the lowest bit left in the bitmask, appending
+			 * its index onto the value of the rune so far.
+			 */
+			*r = (it->r * 64) | ctz64(it->bits);
+			it->bits &= it->bits - 1;
+			return true;
+		}
+
+		if (it->depth > 0) {
+			/*
+			 * Move on to the next nonempty child of the block on
+			 * top of the stack, popping it if there are no more.
+			 * We append its index onto the value of the rune.
+			 */
+			if (it->stk[it->depth - 1].occ == 0) {
+				it->depth--;
+				continue;
+			}
+			c = ctz64(it->stk[it->depth - 1].occ);
+			it->stk[it->depth - 1].occ &= it->stk[it->depth - 1].occ - 1;
+			t = it->stk[it->depth - 1].b->blk[c];
+			n = it->stk[it->depth - 1].n;
+			v = (it->stk[it->depth - 1].r * 64) | c;
+		} else if (it->root) {
+			/*
+			 * Move on to the next nonempty child of the root. As
+			 * for each leading byte (11xxxxxx), we determine the
+			 * number of continuation bytes that will follow it,
+			 * and unpack the bits that will contribute to the value
+			 * of the rune. That is, all of the bits after the
+			 * leading ones.
+			 */
+			c = ctz64(it->root);
+			it->root &= it->root - 1;
+			t = it->set->blk[c];
+			n = clo6[c];        /* there are n+1 bytes left */
+			v = c % (64 >> n);  /* unpack bits for the rune */
+		} else {
+			return false;
+		}
+
+		if (n == 0) {
+			/*
+			 * This is the final byte, so this node's children are
+			 * booleans, which means this is a bitmask.
+			 */
+			it->bits = t.bits;
+			it->r = v;
+		} else {
+			/*
+			 * This is not the final byte, so this node's children
+			 * are also nodes, to be visited next.
+			 */
+			it->stk[it->depth].b = t.ptr;
+			it->stk[it->depth].occ = occupancy(t.ptr, n - 1);
+			it->stk[it->depth].n = n - 1;
+			it->stk[it->depth].r = v;
+			it->depth++;
+		}
+	}
+}
+
+/*
+ * foreach() takes a pointer to a function that takes a rune, and calls that
+ * function for each rune in the set, in ascending order.
+ *
+ * It may be worth noting that if an overlong UTF-8 sequence is entered into the
+ * UTFSet then the runes will not actually be in true ascending order, as the
+ * overlong rune will be reached after the `true' rune. However, since overlong
+ * UTF-8 sequences are illegal, this is not a problem if the input is sanitised,
+ * as it is by addvalidutfs().
+ */
+void
+foreach(const UTFSet *set, void (*fcn)(char32_t))
+{
+	UTFSetIter it;
+	char32_t r;
+
+	utfset_iter_init(&it, set);
+	while (utfset_iter_next(&it, &r)) {
+		fcn(r);
+	}
+}
+
+/*
+ * foreach_ctx() is like foreach(), except that the function is also passed a
+ * context pointer, and can stop the iteration early by returning nonzero, in
+ * which case foreach_ctx() returns that value. Otherwise it returns 0.
+ */
+int
+foreach_ctx(const UTFSet *set, int (*fcn)(char32_t, void *), void *ctx)
+{
+	UTFSetIter it;
+	char32_t r;
+	int ret;
+
+	utfset_iter_init(&it, set);
+	while (utfset_iter_next(&it, &r)) {
+		if ((ret = fcn(r, ctx)) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static size_t card1(union child, unsigned int);
+
+/*
+ * utfset_count() returns the number of runes in the set. Rather than visit
+ * each rune in turn, we add up the set bits in each bitmask, which is a single
+ * instruction on most machines, and a full node holds every rune beneath it.
+ */
+size_t
+utfset_count(const UTFSet *set)
+{
+	size_t count = 0;
+
+	for (unsigned char c = 0; c < 64; c++) {
+		count += card1(set->blk[c], clo6[c]);
+	}
+	return count;
+}
+
+/*
+ * card1() counts the runes in a node, with n bytes still to go after it.
+ */
+size_t
+card1(union child t, unsigned int n)
+{
+	size_t count = 0;
+
+	if (n == 0) {
+		return popcount64(t.bits);
+	} else if (t.ptr == &full[n - 1]) {
+		return (size_t)1 << 6 * (n + 1);
+	} else if (t.ptr) {
+		for (unsigned char c = 0; c < 64; c++) {
+			count += card1(t.ptr->blk[c], n - 1);
+		}
+	}
+	return count;
+}
+
+/*
+ * UTFSetStats describes how much memory a set is using, and where. The blocks
+ * are counted by their depth beneath the root, so that depth[0] counts those
+ * pointed to by the root itself, and also by the child of the root they are
+ * beneath, which is to say by leading byte, in slot[]. The shared full nodes
+ * belong to no set, so they are counted only as references, in fulls, and not
+ * as blocks. The fill is the mean fraction of bits set in nonzero bitmasks.
+ *
+ * If the set has a pool, pooled is the number of bytes in the slabs the pool
+ * has allocated, which may be more than the set's own blocks need, either as
+ * the pool is shared with other sets or as it has blocks not yet handed out.
+ */
+typedef struct utfsetstats {
+	size_t blocks;     /* blocks in the tree */
+	size_t depth[6];   /* blocks at each depth */
+	size_t bytes;      /* bytes in the set and its blocks */
+	size_t pooled;     /* bytes allocated by the pool */
+	size_t leaves;     /* nonzero bitmasks */
+	size_t fulls;      /* references to full nodes */
+	size_t runes;      /* runes in the set */
+	double fill;       /* mean fill of the nonzero bitmasks */
+	struct {
+		size_t blocks, leaves, runes;
+	} slot[64];
+} UTFSetStats;
+
+static void stats1(union child, unsigned int, unsigned int, UTFSetStats *, unsigned char, size_t *);
+
+/*
+ * utfset_stats() fills in st for the set. It visits each block just once, and
+ * touches nothing but the blocks themselves, so it costs about as much as the
+ * utfset_count() it also does the work of.
+ */
+void
+utfset_stats(const UTFSet *set, UTFSetStats *st)
+{
+	size_t bits = 0;
+
+	*st = (UTFSetStats){ 0 };
+	for (unsigned char c = 0; c < 64; c++) {
+		stats1(set->blk[c], clo6[c], 0, st, c, &bits);
+		st->blocks += st->slot[c].blocks;
+		st->leaves += st->slot[c].leaves;
+		st->runes += st->slot[c].runes;
+	}
+	st->bytes = sizeof(UTFSet) + st->blocks * sizeof(struct block);
+	if (set->pool) {
+		for (const struct block *slab = set->pool->slabs; slab; slab = slab->blk[0].ptr) {
+			st->pooled += SLABSIZE;
+		}
+	}
+	st->fill = st->leaves ? (double)bits / (64.0 * st->leaves) : 0;
+}
+
+/*
+ * stats1() adds a node, with n bytes still to go after it, and the given depth
+ * beneath the root, to the stats for slot c, and any bits set in its bitmasks
+ * to *bits, for the fill.
+ */
+void
+stats1(union child t, unsigned int n, unsigned int depth, UTFSetStats *st, unsigned char c, size_t *bits)
+{
+	if (n == 0) {
+		if (t.bits) {
+			st->slot[c].leaves++;
+			st->slot[c].runes += popcount64(t.bits);
+			*bits += popcount64(t.bits);
+		}
+	} else if (t.ptr == &full[n - 1]) {
+		st->fulls++;
+		st->slot[c].runes += (size_t)1 << 6 * (n + 1);
+	} else if (t.ptr) {
+		st->depth[depth]++;
+		st->slot[c].blocks++;
+		for (unsigned char i = 0; i < 64; i++) {
+			stats1(t.ptr->blk[i], n - 1, depth + 1, st, c, bits);
+		}
+	}
+}
+
+static void free1(union child, unsigned int, UTFPool *);
+
+/*
+ * utfset_free() frees all of the blocks in the set, which is left empty, and
+ * still using the same pool, so it can be reused.
+ */
+void
+utfset_free(UTFSet *set)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (clo6[c] == 0) {
+			set->blk[c].bits = 0;
+		} else {
+			free1(set->blk[c], clo6[c], set->pool);
+			set->blk[c].ptr = NULL;
+		}
+	}
+}
+
+/*
+ * free1() frees a node in the tree, with n bytes still to go after it, so that
+ * n == 0 means the node is a bitmask, which has nothing to free. Neither have
+ * the shared full nodes.
+ */
+void
+free1(union child t, unsigned int n, UTFPool *pool)
+{
+	if (n > 0 && t.ptr && t.ptr != &full[n - 1]) {
+		for (unsigned char c = 0; c < 64; c++) {
+			free1(t.ptr->blk[c], n - 1, pool);
+		}
+		freeblock(pool, t.ptr);
+	}
+}
+
+/*
+ * delutf() removes the next rune in the UTF-8 string from the UTFSet, if it is
+ * there, and returns a pointer to the byte following that rune, or NULL if the
+ * string doesn't start with a rune, or if we run out of memory. It walks the
+ * same path as addutf(), remembering each child it passes through, so that if
+ * clearing the rune's bit leaves its bitmask empty, it can climb back up and
+ * free each block that is left with nothing in it. That way a set that churns
+ * takes up only as much memory as the runes it currently holds.
+ *
+ * If the path passes through a full node, which is shared, we replace it with
+ * a private copy before going any further, so that we can clear the bit.
+ */
+const char *
+delutf(UTFSet *set, const char *s)
+{
+	union child *path[6], *tp;
+	unsigned int depth = 0, n;
+	unsigned char c = *s++;
+
+	if (c >= 0300) {
+		tp = &set->blk[c % 64];
+		for (n = clo6[c % 64]; c = *s++, n > 0; n--) {
+			if (!tp->ptr) {
+				return s + n; /* not in the set */
+			} else if (tp->ptr == &full[n - 1] && unshare(tp, n, set->pool) < 0) {
+				return NULL; /* out of memory */
+			}
+			path[depth++] = tp;
+			tp = &tp->ptr->blk[c % 64];
+		}
+	} else if (c < 0200) {
+		tp = &set->blk[c / 64]; /* see addutf() */
+	} else {
+		return NULL; /* not the start of a rune */
+	}
+
+	tp->bits &= ~(UINT64_C(1) << (c % 64));
+
+	/*
+	 * Now tp is empty, if the rune was the last in its bitmask, in which
+	 * case we check the block it is in, and then the one above that, and
+	 * so on, until we find one that still has something else in it.
+	 */
+	for (n = 0; depth > 0 && !occupied(*tp, n); n++) {
+		tp = path[--depth];
+		if (occupancy(tp->ptr, n) != 0) {
+			break;
+		}
+		freeblock(set->pool, tp->ptr);
+		tp->ptr = NULL;
+	}
+
+	return s;
+}
+
+static int copy1(union child *, union child, unsigned int, UTFPool *);
+static int union1(union child *, union child, unsigned int, UTFPool *);
+static int intersect1(union child *, union child, unsigned int, UTFPool *);
+static int subtract1(union child *, union child, unsigned int, UTFPool *);
+static void collapse(union child *, unsigned int, UTFPool *);
+
+/*
+ * utfset_union() adds every rune in src to dst. Since both trees have the same
+ * shape, we can walk them in lockstep, or-ing together their bitmasks. Where
+ * dst has no block but src does, the whole of src's subtree is copied into dst
+ * in one go, and where either is full, the result is too. Returns 0 on success,
+ * or -1 if we run out of memory, in which case dst may have gained only some of
+ * the runes in src.
+ */
+int
+utfset_union(UTFSet *dst, const UTFSet *src)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (union1(&dst->blk[c], src->blk[c], clo6[c], dst->pool) < 0) {
+			return -1; /* out of memory */
+		}
+	}
+	return 0;
+}
+
+/*
+ * utfset_intersect() removes every rune from dst that is not in src. We and
+ * together the bitmasks, and where src has no block, dst's whole subtree can be
+ * freed. Any of dst's blocks that are left empty are freed as well. Returns 0
+ * on success, or -1 if we run out of memory, which can only happen where dst
+ * has a full subtree that must be replaced by a copy of src's.
+ */
+int
+utfset_intersect(UTFSet *dst, const UTFSet *src)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (intersect1(&dst->blk[c], src->blk[c], clo6[c], dst->pool) < 0) {
+			return -1; /* out of memory */
+		}
+	}
+	return 0;
+}
+
+/*
+ * utfset_subtract() removes every rune from dst that is in src. We and dst's
+ * bitmasks with the complement of src's, skipping any subtrees where dst or src
+ * has no block. Any of dst's blocks that are left empty are freed. Returns 0 on
+ * success, or -1 if we run out of memory, which can only happen where dst has a
+ * full subtree that must be unshared.
+ */
+int
+utfset_subtract(UTFSet *dst, const UTFSet *src)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (subtract1(&dst->blk[c], src->blk[c], clo6[c], dst->pool) < 0) {
+			return -1; /* out of memory */
+		}
+	}
+	return 0;
+}
+
+/*
+ * The following workhorses apply to an individual node in each tree, either of
+ * which may be a pointer or a bitmask, with n bytes still to go after it, as in
+ * free1(). The node in dst is passed by pointer, so that it can be changed.
+ *
+ * copy1() sets the node to a copy of the other, allocating blocks from the pool,
+ * except that full nodes are shared rather than copied. If it runs out of
+ * memory, it leaves a partial copy behind and returns -1.
+ */
+int
+copy1(union child *d, union child s, unsigned int n, UTFPool *pool)
+{
+	if (n == 0 || !s.ptr || s.ptr == &full[n - 1]) {
+		*d = s;
+	} else {
+		if (!(d->ptr = newblock(pool))) {
+			return -1; /* out of memory */
+		}
+		for (unsigned char c = 0; c < 64; c++) {
+			if (copy1(&d->ptr->blk[c], s.ptr->blk[c], n - 1, pool) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * union1() is the workhorse for utfset_union(), returning -1 like copy1(). A
+ * node in dst that ends up with all of its children full is collapsed into the
+ * shared full node.
+ */
+int
+union1(union child *d, union child s, unsigned int n, UTFPool *pool)
+{
+	if (n == 0) {
+		d->bits |= s.bits;
+	} else if (s.ptr && !isfull(*d, n)) {
+		if (!d->ptr || isfull(s, n)) {
+			free1(*d, n, pool);
+			return copy1(d, s, n, pool);
+		}
+		for (unsigned char c = 0; c < 64; c++) {
+			if (union1(&d->ptr->blk[c], s.ptr->blk[c], n - 1, pool) < 0) {
+				return -1;
+			}
+		}
+		collapse(d, n, pool);
+	}
+	return 0;
+}
+
+/*
+ * intersect1() and subtract1() are the workhorses for utfset_intersect() and
+ * utfset_subtract(). They return whether the node in dst is still occupied
+ * afterward, so that its parent can tell when it is left with nothing at all,
+ * or -1 if they run out of memory.
+ */
+int
+intersect1(union child *d, union child s, unsigned int n, UTFPool *pool)
+{
+	bool any = false;
+
+	if (n == 0) {
+		return (d->bits &= s.bits) != 0;
+	} else if (!d->ptr) {
+		return false;
+	} else if (!s.ptr) {
+		free1(*d, n, pool);
+		d->ptr = NULL;
+		return false;
+	} else if (isfull(s, n)) {
+		return true;
+	} else if (isfull(*d, n)) {
+		return copy1(d, s, n, pool) < 0 ? -1 : true;
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		int ret = intersect1(&d->ptr->blk[c], s.ptr->blk[c], n - 1, pool);
+
+		if (ret < 0) {
+			return -1;
+		}
+		any |= ret;
+	}
+	if (!any) {
+		freeblock(pool, d->ptr);
+		d->ptr = NULL;
+	}
+	return any;
+}
+
+int
+subtract1(union child *d, union child s, unsigned int n, UTFPool *pool)
+{
+	bool any = false;
+
+	if (n == 0) {
+		return (d->bits &= ~s.bits) != 0;
+	} else if (!d->ptr || !s.ptr) {
+		return d->ptr != NULL;
+	} else if (isfull(s, n)) {
+		free1(*d, n, pool);
+		d->ptr = NULL;
+		return false;
+	} else if (isfull(*d, n) && unshare(d, n, pool) < 0) {
+		return -1;
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		int ret = subtract1(&d->ptr->blk[c], s.ptr->blk[c], n - 1, pool);
+
+		if (ret < 0) {
+			return -1;
+		}
+		any |= ret;
+	}
+	if (!any) {
+		freeblock(pool, d->ptr);
+		d->ptr = NULL;
+	}
+	return any;
+}
+
+/*
+ * collapse() replaces a block, with n > 0 bytes still to go after it, by the
+ * shared full node if all of its children are full already. Blocks which are
+ * merely identical to one another are not shared, only full ones, but that is
+ * enough to keep large ranges cheap.
+ */
+void
+collapse(union child *t, unsigned int n, UTFPool *pool)
+{
+	if (t->ptr == &full[n - 1]) {
+		return;
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		if (!isfull(t->ptr->blk[c], n - 1)) {
+			return;
+		}
+	}
+	freeblock(pool, t->ptr);
+	t->ptr = &full[n - 1];
+}
+
+static void merge1(union child *, union child, unsigned int, UTFPool *);
+
+/*
+ * utfset_merge() is like utfset_union(), but it consumes src, which is left
+ * empty, so that rather than copy the subtrees that only src has, dst can
+ * simply adopt them, and free any of src's blocks it does not need. Merging
+ * sets with few runes in common thus costs little more than the root. If the
+ * sets use different pools, then dst cannot adopt blocks from src's, so we fall
+ * back on utfset_union() and then free src. Returns -1 if we run out of memory.
+ */
+int
+utfset_merge(UTFSet *dst, UTFSet *src)
+{
+	int ret;
+
+	if (dst->pool != src->pool) {
+		ret = utfset_union(dst, src);
+		utfset_free(src);
+		return ret;
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		merge1(&dst->blk[c], src->blk[c], clo6[c], dst->pool);
+		src->blk[c] = (union child){ 0 };
+	}
+	return 0;
+}
+
+/*
+ * merge1() is the workhorse for utfset_merge(). It takes ownership of the node
+ * from src, so it never needs to allocate anything.
+ */
+void
+merge1(union child *d, union child s, unsigned int n, UTFPool *pool)
+{
+	if (n == 0) {
+		d->bits |= s.bits;
+	} else if (!s.ptr) {
+		/* nothing to add */
+	} else if (isfull(*d, n)) {
+		free1(s, n, pool);
+	} else if (!d->ptr || isfull(s, n)) {
+		free1(*d, n, pool);
+		*d = s;
+	} else {
+		for (unsigned char c = 0; c < 64; c++) {
+			merge1(&d->ptr->blk[c], s.ptr->blk[c], n - 1, pool);
+		}
+		freeblock(pool, s.ptr);
+		collapse(d, n, pool);
+	}
+}
+
+/*
+ * utfset_build_parallel() adds every rune in the first len bytes of the UTF-8
+ * string to the set, as addutfs() does, but splits the work between nthreads
+ * threads. Each thread builds a set of its own from its share of the string,
+ * and once they are all done we merge them into the set one after another.
+ * Returns 0 on success, or -1 if any share could not be added in full, as for
+ * addutfs(), or we run out of memory, in which case the set may have gained
+ * only some of the runes. Without threads, this just calls addutfs().
+ *
+ * The string is split into roughly equal shares, each moved on past any
+ * continuation bytes, so that no rune is split between threads.
+ */
+#if defined(HAVE_PTHREADS)
+struct job {
+	UTFSet set;
+	const char *s;
+	size_t len;
+	bool ok;
+};
+
+static void *
+build1(void *arg)
+{
+	struct job *j = arg;
+
+	j->ok = addutfs(&j->set, j->s, j->len) == j->s + j->len;
+	return NULL;
+}
+
+int
+utfset_build_parallel(UTFSet *set, const char *buf, size_t len, int nthreads)
+{
+	struct job *jobs;
+	pthread_t *tids;
+	bool *started;
+	size_t start = 0, end;
+	int ret = 0;
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	jobs = calloc(nthreads, sizeof(*jobs));
+	tids = calloc(nthreads, sizeof(*tids));
+	started = calloc(nthreads, sizeof(*started));
+	if (!jobs || !tids || !started) {
+		free(jobs);
+		free(tids);
+		free(started);
+		return -1; /* out of memory */
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		end = i == nthreads - 1 ? len : len / nthreads * (i + 1);
+		if (end < start) {
+			end = start;
+		}
+		while (end < len && ((unsigned char)buf[end] & 0300) == 0200) {
+			end++;
+		}
+		jobs[i].s = buf + start;
+		jobs[i].len = end - start;
+		start = end;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		/*
+		 * If we can't start another thread, then we do its share of
+		 * the work ourselves, rather than give up.
+		 */
+		if (!(started[i] = pthread_create(&tids[i], NULL, build1, &jobs[i]) == 0)) {
+			build1(&jobs[i]);
+		}
+	}
+	for (int i = 0; i < nthreads; i++) {
+		if (started[i]) {
+			pthread_join(tids[i], NULL);
+		}
+		if (!jobs[i].ok || utfset_merge(set, &jobs[i].set) < 0) {
+			ret = -1;
+		}
+		utfset_free(&jobs[i].set);
+	}
+
+	free(jobs);
+	free(tids);
+	free(started);
+	return ret;
+}
+#else
+int
+utfset_build_parallel(UTFSet *set, const char *buf, size_t len, int nthreads)
+{
+	(void)nthreads;
+	return addutfs(set, buf, len) == buf + len ? 0 : -1;
+}
+#endif
+
+static bool equal1(union child, union child, unsigned int);
+static bool subset1(union child, union child, unsigned int);
+static uint64_t hash1(union child, unsigned int, const uint64_t *);
+
+/*
+ * utfset_equal() returns whether the two sets have just the same runes, and
+ * utfset_is_subset() whether every rune in a is also in b. Rather than list the
+ * runes of each, they walk both trees together, comparing the bitmasks, and
+ * need go no further down wherever the two point to the same block, as they do
+ * for full nodes, or wherever a has nothing for subset. Where one tree has a
+ * block and the other has none, we compare the block with none.
+ */
+bool
+utfset_equal(const UTFSet *a, const UTFSet *b)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (!equal1(a->blk[c], b->blk[c], clo6[c])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+utfset_is_subset(const UTFSet *a, const UTFSet *b)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		if (!subset1(a->blk[c], b->blk[c], clo6[c])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * mix64() scrambles the bits of a 64-bit integer, as the finalizer of the
+ * SplitMix64 generator does. It maps 0 to 0, and nothing else to 0.
+ */
+static inline uint64_t
+mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= UINT64_C(0xBF58476D1CE4E5B9);
+	x ^= x >> 27;
+	x *= UINT64_C(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+/*
+ * combine() adds the hash h of child c into the hash of its parent. The sum is
+ * over only nonempty children, so an empty block hashes to 0 just as a null
+ * pointer does, and mixing in c makes it depend on where each child is.
+ */
+static inline uint64_t
+combine(uint64_t sum, uint64_t h, unsigned int c)
+{
+	return h ? sum + mix64(h + c * UINT64_C(0x9E3779B97F4A7C15)) : sum;
+}
+
+/*
+ * utfset_hash() returns a hash of the runes in the set, such that equal sets
+ * hash the same, however their trees came to be shaped, and whichever machine
+ * or process they happen to be in, since it depends on nothing but the bits.
+ * The hash of a node is made from those of its children, and those of the full
+ * nodes, which would otherwise take a walk over every rune to compute, can be
+ * worked out from one another in just six steps.
+ */
+uint64_t
+utfset_hash(const UTFSet *set)
+{
+	uint64_t fullhash[6], h = 0;
+
+	for (unsigned int n = 0; n < 6; n++) {
+		uint64_t sub = n == 0 ? mix64(~UINT64_C(0)) : fullhash[n - 1];
+
+		fullhash[n] = 0;
+		for (unsigned int c = 0; c < 64; c++) {
+			fullhash[n] = combine(fullhash[n], sub, c);
+		}
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		h = combine(h, hash1(set->blk[c], clo6[c], fullhash), c);
+	}
+	return mix64(h);
+}
+
+/*
+ * equal1(), subset1() and hash1() are the workhorses for the above, comparing
+ * or hashing nodes with n bytes still to go after them.
+ */
+bool
+equal1(union child a, union child b, unsigned int n)
+{
+	const struct block *pa, *pb;
+
+	if (n == 0) {
+		return a.bits == b.bits;
+	} else if (a.ptr == b.ptr) {
+		return true;
+	}
+	pa = a.ptr ? a.ptr : &none;
+	pb = b.ptr ? b.ptr : &none;
+	for (unsigned char c = 0; c < 64; c++) {
+		if (!equal1(pa->blk[c], pb->blk[c], n - 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool
+subset1(union child a, union child b, unsigned int n)
+{
+	const struct block *pb;
+
+	if (n == 0) {
+		return (a.bits & ~b.bits) == 0;
+	} else if (a.ptr == b.ptr || !a.ptr || b.ptr == &full[n - 1]) {
+		return true;
+	}
+	pb = b.ptr ? b.ptr : &none;
+	for (unsigned char c = 0; c < 64; c++) {
+		if (!subset1(a.ptr->blk[c], pb->blk[c], n - 1)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+uint64_t
+hash1(union child t, unsigned int n, const uint64_t *fullhash)
+{
+	uint64_t h = 0;
+
+	if (n == 0) {
+		return mix64(t.bits);
+	} else if (!t.ptr) {
+		return 0;
+	} else if (t.ptr == &full[n - 1]) {
+		return fullhash[n - 1];
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		h = combine(h, hash1(t.ptr->blk[c], n - 1, fullhash), c);
+	}
+	return h;
+}
+
+/*
+ * Where a rune appears at the root depends on how many continuation bytes its
+ * leading byte would be followed by beyond the first, n, as given by clo6[].
+ * This is 0 for runes below U+0800 (ASCII included, as described in addutf()),
+ * 1 for those below U+10000, and 2 for the rest. The children of the root for
+ * a given n start at index 64 - (64 >> n), and each covers 64^(n+1) runes, so
+ * we can find the child for a rune r at index 64 - (64 >> n) + (r >> 6(n+1)).
+ * Here first[n] is the first rune for each n (apart from overlong ones).
+ */
+static const char32_t first[] = { 0x0, 0x800, 0x10000, 0x110000 };
+
+static int addspan(union child *, unsigned int, char32_t, char32_t, UTFPool *);
+static bool hasspan(const union child *, unsigned int, char32_t, char32_t);
+
+/*
+ * utfset_add_range() adds every rune from lo up to hi inclusive to the set.
+ * Rather than descend once per rune, we descend once per range, splitting it
+ * between children only where it straddles them, so that a bitmask which is
+ * entirely within the range is filled in a single store. Returns 0 on success,
+ * or -1 if the range is empty or beyond U+10FFFF, or if we run out of memory,
+ * in which case only some of the runes may have been added.
+ */
+int
+utfset_add_range(UTFSet *set, char32_t lo, char32_t hi)
+{
+	if (lo > hi || hi >= first[3]) {
+		return -1; /* invalid range */
+	}
+	for (unsigned int n = 0; n < 3; n++) {
+		char32_t a = lo > first[n] ? lo : first[n];
+		char32_t b = hi < first[n + 1] - 1 ? hi : first[n + 1] - 1;
+
+		if (a <= b && addspan(&set->blk[64 - (64 >> n)], n, a, b, set->pool) < 0) {
+			return -1; /* out of memory */
+		}
+	}
+	return 0;
+}
+
+/*
+ * utfset_has_any_in_range() returns whether any rune from lo up to hi inclusive
+ * is in the set, walking the tree in just the same way. It can stop as soon as
+ * it finds a bitmask with any bits set in the range.
+ */
+bool
+utfset_has_any_in_range(const UTFSet *set, char32_t lo, char32_t hi)
+{
+	if (hi >= first[3]) {
+		hi = first[3] - 1;
+	}
+	for (unsigned int n = 0; n < 3; n++) {
+		char32_t a = lo > first[n] ? lo : first[n];
+		char32_t b = hi < first[n + 1] - 1 ? hi : first[n + 1] - 1;
+
+		if (a <= b && hasspan(&set->blk[64 - (64 >> n)], n, a, b)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * addspan() and hasspan() are the workhorses for the above. They apply to an
+ * array of 64 children blk[], each with n bytes still to go after it, so that
+ * each covers 64^(n+1) runes, and a range from lo up to hi within them all.
+ * This range is split between the children it overlaps, with the first and
+ * last of them getting only part of it.
+ */
+int
+addspan(union child *blk, unsigned int n, char32_t lo, char32_t hi, UTFPool *pool)
+{
+	unsigned int shift = 6 * (n + 1);
+	char32_t size = (char32_t)1 << shift;
+
+	for (char32_t i = lo >> shift; i <= hi >> shift; i++) {
+		char32_t clo = i == lo >> shift ? lo % size : 0;
+		char32_t chi = i == hi >> shift ? hi % size : size - 1;
+
+		if (n == 0) {
+			blk[i].bits |= (~UINT64_C(0) << clo) & (~UINT64_C(0) >> (63 - chi));
+		} else if (blk[i].ptr == &full[n - 1]) {
+			continue; /* already full */
+		} else if (clo == 0 && chi == size - 1) {
+			free1(blk[i], n, pool);
+			blk[i].ptr = &full[n - 1];
+		} else {
+			if (!blk[i].ptr && !(blk[i].ptr = newblock(pool))) {
+				return -1; /* out of memory */
+			}
+			if (addspan(blk[i].ptr->blk, n - 1, clo, chi, pool) < 0) {
+				return -1;
+			}
+			collapse(&blk[i], n, pool);
+		}
+	}
+	return 0;
+}
+
+bool
+hasspan(const union child *blk, unsigned int n, char32_t lo, char32_t hi)
+{
+	unsigned int shift = 6 * (n + 1);
+	char32_t size = (char32_t)1 << shift;
+
+	for (char32_t i = lo >> shift; i <= hi >> shift; i++) {
+		char32_t clo = i == lo >> shift ? lo % size : 0;
+		char32_t chi = i == hi >> shift ? hi % size : size - 1;
+
+		if (n == 0) {
+			if (blk[i].bits & (~UINT64_C(0) << clo) & (~UINT64_C(0) >> (63 - chi))) {
+				return true;
+			}
+		} else if (blk[i].ptr && hasspan(blk[i].ptr->blk, n - 1, clo, chi)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int range1(const union child *, unsigned int, char32_t, char32_t, char32_t, int (*)(char32_t, void *), void *);
+static bool prev1(const union child *, unsigned int, char32_t, char32_t, char32_t *);
+
+/*
+ * foreach_range() is like foreach_ctx(), but only for the runes from lo up to
+ * hi inclusive. Rather than start from U+0000 and skip the runes before lo,
+ * it splits the range between children just as utfset_add_range() does, and
+ * so goes straight down to the first bitmask in the range, never visiting any
+ * child outside it, nor any beneath a null pointer.
+ */
+int
+foreach_range(const UTFSet *set, char32_t lo, char32_t hi, int (*fcn)(char32_t, void *), void *ctx)
+{
+	int ret;
+
+	if (hi >= first[3]) {
+		hi = first[3] - 1;
+	}
+	for (unsigned int n = 0; n < 3; n++) {
+		char32_t a = lo > first[n] ? lo : first[n];
+		char32_t b = hi < first[n + 1] - 1 ? hi : first[n + 1] - 1;
+
+		if (a <= b && (ret = range1(&set->blk[64 - (64 >> n)], n, a, b, 0, fcn, ctx)) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * setnext() is passed by utfset_next() to foreach_range(), to stop it at the
+ * first rune it finds.
+ */
+static int
+setnext(char32_t r, void *ctx)
+{
+	*(char32_t *)ctx = r;
+	return 1;
+}
+
+/*
+ * utfset_next() finds the first rune in the set at or after r, and utfset_prev()
+ * the last at or before it, storing it in *next or *prev. They return false if
+ * there is no such rune. Each needs only one step down the tree per byte, plus
+ * whatever it takes to skip over the empty children along the way, so to page
+ * through a set we can ask for the rune after the last one we saw.
+ */
+bool
+utfset_next(const UTFSet *set, char32_t r, char32_t *next)
+{
+	return foreach_range(set, r, first[3] - 1, setnext, next) != 0;
+}
+
+bool
+utfset_prev(const UTFSet *set, char32_t r, char32_t *prev)
+{
+	if (r >= first[3]) {
+		r = first[3] - 1;
+	}
+	for (unsigned int n = 3; n-- > 0;) {
+		char32_t b = r < first[n + 1] - 1 ? r : first[n + 1] - 1;
+
+		if (r >= first[n] && prev1(&set->blk[64 - (64 >> n)], n, first[n], b, prev)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * range1() and prev1() split the range from lo up to hi between the children
+ * in blk[] in the same way as addspan(). To know which rune a bit stands for,
+ * range1() is passed the value of the first rune beneath blk[], in base, and
+ * prev1() adds it on as it returns back up the tree.
+ */
+int
+range1(const union child *blk, unsigned int n, char32_t lo, char32_t hi, char32_t base, int (*fcn)(char32_t, void *), void *ctx)
+{
+	unsigned int shift = 6 * (n + 1);
+	char32_t size = (char32_t)1 << shift;
+	int ret;
+
+	for (char32_t i = lo >> shift; i <= hi >> shift; i++) {
+		char32_t clo = i == lo >> shift ? lo % size : 0;
+		char32_t chi = i == hi >> shift ? hi % size : size - 1;
+
+		if (n == 0) {
+			uint64_t bits = blk[i].bits & (~UINT64_C(0) << clo) & (~UINT64_C(0) >> (63 - chi));
+
+			for (; bits; bits &= bits - 1) {
+				if ((ret = fcn(base + i * 64 + ctz64(bits), ctx)) != 0) {
+					return ret;
+				}
+			}
+		} else if (blk[i].ptr == &full[n - 1]) {
+			for (char32_t c = clo; c <= chi; c++) {
+				if ((ret = fcn(base + (i << shift) + c, ctx)) != 0) {
+					return ret;
+				}
+			}
+		} else if (blk[i].ptr && (ret = range1(blk[i].ptr->blk, n - 1, clo, chi, base + (i << shift), fcn, ctx)) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+bool
+prev1(const union child *blk, unsigned int n, char32_t lo, char32_t hi, char32_t *r)
+{
+	unsigned int shift = 6 * (n + 1);
+	char32_t size = (char32_t)1 << shift;
+
+	for (char32_t i = (hi >> shift) + 1; i-- > lo >> shift;) {
+		char32_t clo = i == lo >> shift ? lo % size : 0;
+		char32_t chi = i == hi >> shift ? hi % size : size - 1;
+
+		if (n == 0) {
+			uint64_t bits = blk[i].bits & (~UINT64_C(0) << clo) & (~UINT64_C(0) >> (63 - chi));
+
+			if (bits) {
+				*r = i * 64 + 63 - clz64(bits);
+				return true;
+			}
+		} else if (blk[i].ptr == &full[n - 1]) {
+			*r = (i << shift) + chi;
+			return true;
+		} else if (blk[i].ptr && prev1(blk[i].ptr->blk, n - 1, clo, chi, r)) {
+			*r += i << shift;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * utfset_complement() replaces the set with every valid rune not in it, where
+ * the valid runes are all of those up to U+10FFFF except for the surrogates,
+ * U+D800 to U+DFFF, which UTF-8 has no business encoding. We first build the
+ * set of all the valid runes: that is almost entirely made of full nodes, and
+ * needs only the four blocks for the leading bytes E0, ED, F0 and F4, which
+ * are each only partly valid. From that we subtract the set, which unshares
+ * only the full nodes above the runes it has. So the complement takes space in
+ * proportion to the set, and every other operation can treat it as it would
+ * any other set. Complementing twice leaves only the set's valid runes.
+ *
+ * Returns 0 on success, or -1 if we run out of memory, in which case the set is
+ * left as it was.
+ */
+int
+utfset_complement(UTFSet *set)
+{
+	static const char32_t valid[][2] = { { 0x0, 0xD7FF }, { 0xE000, 0x10FFFF } };
+	UTFSet u = { .pool = set->pool };
+
+	for (unsigned int i = 0; i < 2; i++) {
+		if (utfset_add_range(&u, valid[i][0], valid[i][1]) < 0) {
+			utfset_free(&u);
+			return -1; /* out of memory */
+		}
+	}
+	if (utfset_subtract(&u, set) < 0) {
+		utfset_free(&u);
+		return -1; /* out of memory */
+	}
+	utfset_free(set);
+	*set = u;
+
+	return 0;
+}
+
+/*
+ * Once a set has been built, it is often never changed again, and yet most of
+ * its blocks may have only a few of their 64 children occupied. So a set can
+ * be frozen into a FrozenUTFSet, a read-only copy of the tree which is stored
+ * in a single array of 64-bit words, with no pointers and no empty children.
+ *
+ * The first 64 words are the root, indexed by leading byte just as the root of
+ * a UTFSet is: each is either a bitmask, or else the offset of a node from the
+ * start of the array, or 0 if there is none. Each node is then stored as an
+ * occupancy mask, as used by UTFSetIter, followed by its occupied children, in
+ * order, which are again bitmasks or offsets depending on how many bytes are
+ * still to go. To find child i of a node we count how many children before it
+ * are occupied, that is, the set bits in the mask below bit i, and that gives
+ * us its index among the children that follow.
+ *
+ * Since the tree can no longer change, we can also afford to store how many
+ * runes come before each child of a node whose children are themselves nodes:
+ * its children are followed by the counts for those, relative to the start of
+ * the node, with one more count at the end for all of the runes in the node.
+ * The counts are packed two to a word, as 32 bits is plenty for every rune up
+ * to U+1FFFFF, which is as far as UTF-8 with four bytes goes. Likewise, if the
+ * root has any nodes among its children, it is followed by a mask of which of
+ * them are nodes, and then the counts for those, with one more for all of the
+ * runes in the set. With these, frozen_rank() and frozen_select() need only a
+ * step down the tree per byte, rather than a count of every rune.
+ *
+ * The nodes whose children are bitmasks get no counts, as there are far more
+ * of them than of any other node, and the counts would take up nearly half as
+ * much room again as their children do. For those we just add up popcounts of
+ * the bitmasks before the child we want, which lie in the same few cache lines.
+ * The same goes for the root's first 32 children, which are always bitmasks,
+ * and there are no counts at all for a root with no nodes among its children.
+ *
+ * The array is allocated by utfset_freeze() itself, and kept in mem, to be
+ * freed by frozen_free(), unless it was mapped from a file by utfset_map(), in
+ * which case maplen is the length of the mapping, for frozen_free() to unmap.
+ */
+typedef struct frozenutfset {
+	const uint64_t *w;
+	size_t len;     /* number of words */
+	void *mem;
+	size_t maplen;  /* bytes mapped, if any */
+} FrozenUTFSet;
+
+#define ROOTLEN 64
+
+static size_t count1(union child, unsigned int);
+static uint64_t freeze1(const struct block *, unsigned int, uint64_t *, size_t *, uint64_t *, uint64_t *);
+
+/*
+ * putcount() and getcount() store and load the ith 32-bit count in the array
+ * starting at w.
+ */
+static inline void
+putcount(uint64_t *w, unsigned int i, uint64_t count)
+{
+	if (i % 2 == 0) {
+		w[i / 2] = count & 0xFFFFFFFF;
+	} else {
+		w[i / 2] |= count << 32;
+	}
+}
+
+static inline uint64_t
+getcount(const uint64_t *w, unsigned int i)
+{
+	return (w[i / 2] >> (i % 2 * 32)) & 0xFFFFFFFF;
+}
+
+/*
+ * utfset_freeze() freezes the set into f, returning 0 on success or -1 if we
+ * run out of memory.
+ */
+int
+utfset_freeze(FrozenUTFSet *f, const UTFSet *set)
+{
+	uint64_t *w, fulls[6] = { 0 }, nodes = 0, count = 0, sub;
+	size_t len = ROOTLEN + 18 + 6 * 98;
+	unsigned int k = 0;
+	void *mem;
+
+	/*
+	 * No node can take up more than 98 words, nor the root's counts more
+	 * than 18, so we allocate enough for every block to be full, and then
+	 * shrink the array to fit afterward. The shared full nodes, which
+	 * count1() skips, are frozen at most once each, and fulls[] keeps their
+	 * offsets so they can be shared again.
+	 */
+	for (unsigned char c = 0; c < 64; c++) {
+		len += count1(set->blk[c], clo6[c]) * 98;
+	}
+	if (!(w = malloc(len * sizeof(uint64_t)))) {
+		return -1; /* out of memory */
+	}
+
+	/*
+	 * The root's counts go straight after it, so we need to know how many
+	 * of its children are nodes before we freeze any of them.
+	 */
+	for (unsigned char c = 0; c < 64; c++) {
+		if (clo6[c] > 0 && set->blk[c].ptr) {
+			nodes |= UINT64_C(1) << c;
+		}
+	}
+	len = ROOTLEN;
+	if (nodes) {
+		w[len] = nodes;
+		len += 1 + (popcount64(nodes) + 2) / 2;
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		sub = 0;
+		if (clo6[c] == 0) {
+			w[c] = set->blk[c].bits;
+			sub = popcount64(w[c]);
+		} else if (set->blk[c].ptr) {
+			putcount(&w[ROOTLEN + 1], k++, count);
+			w[c] = freeze1(set->blk[c].ptr, clo6[c] - 1, w, &len, fulls, &sub);
+		} else {
+			w[c] = 0;
+		}
+		count += sub;
+	}
+	if (nodes) {
+		putcount(&w[ROOTLEN + 1], k, count);
+	}
+
+	mem = realloc(w, len * sizeof(uint64_t));
+	f->mem = mem ? mem : w; /* if we couldn't shrink it, that's fine */
+	f->w = f->mem;
+	f->len = len;
+	f->maplen = 0;
+	return 0;
+}
+
+/*
+ * count1() counts the blocks in a node of a UTFSet, with n bytes still to go
+ * after the node, as in free1(). The shared full nodes are not counted.
+ */
+size_t
+count1(union child t, unsigned int n)
+{
+	size_t count = 0;
+
+	if (n > 0 && t.ptr && t.ptr != &full[n - 1]) {
+		for (unsigned char c = 0; c < 64; c++) {
+			count += count1(t.ptr->blk[c], n - 1);
+		}
+		count++;
+	}
+	return count;
+}
+
+/*
+ * freeze1() appends a block to the array, after first appending each of its
+ * children that is itself a block, since we need to know their offsets before
+ * we can store them. The block has n bytes still to go after its children, and
+ * fulls[] holds the offsets of any shared full nodes frozen already, since the
+ * frozen nodes can be shared just the same. Returns the offset of the new node,
+ * or 0 if the block turns out to have no runes in it at all, and stores the
+ * number of runes in it in *count.
+ */
+uint64_t
+freeze1(const struct block *b, unsigned int n, uint64_t *w, size_t *len, uint64_t *fulls, uint64_t *count)
+{
+	uint64_t occ = 0, v[64], sub[64];
+	unsigned int k = 0;
+	size_t off;
+
+	if (b == &full[n] && fulls[n]) {
+		*count = UINT64_C(1) << 6 * (n + 2);
+		return fulls[n];
+	}
+	for (unsigned char c = 0; c < 64; c++) {
+		sub[k] = 0;
+		if (n == 0) {
+			v[k] = b->blk[c].bits;
+			sub[k] = popcount64(v[k]);
+		} else if (b->blk[c].ptr) {
+			v[k] = freeze1(b->blk[c].ptr, n - 1, w, len, fulls, &sub[k]);
+		} else {
+			v[k] = 0;
+		}
+		if (v[k] != 0) {
+			occ |= UINT64_C(1) << c;
+			k++;
+		}
+	}
+	*count = 0;
+	if (occ == 0) {
+		return 0;
+	}
+
+	off = *len;
+	w[(*len)++] = occ;
+	memcpy(&w[*len], v, k * sizeof(uint64_t));
+	*len += k;
+	for (unsigned int i = 0; i < k; i++) {
+		if (n > 0) {
+			putcount(&w[*len], i, *count);
+		}
+		*count += sub[i];
+	}
+	if (n > 0) {
+		putcount(&w[*len], k, *count);
+		*len += (k + 2) / 2;
+	}
+	if (b == &full[n]) {
+		fulls[n] = off;
+	}
+	return off;
+}
+
+/*
+ * frozen_free() frees the array of a FrozenUTFSet, if it has one to free, or
+ * unmaps it.
+ */
+void
+frozen_free(FrozenUTFSet *f)
+{
+#if defined(HAVE_MMAP)
+	if (f->maplen) {
+		munmap(f->mem, f->maplen);
+		*f = (FrozenUTFSet){ 0 };
+		return;
+	}
+#endif
+	free(f->mem);
+	*f = (FrozenUTFSet){ 0 };
+}
+
+/*
+ * frozen_hasutf() and frozen_hasrune() are just like hasutf() and hasrune(),
+ * but for a FrozenUTFSet. Each step down the tree needs one more load than for
+ * a UTFSet, for the occupancy mask, but it is from the same cache line as the
+ * child, and the nodes are far smaller and closer together.
+ */
+const char *
+frozen_hasutf(const FrozenUTFSet *f, const char *s, bool *in)
+{
+	uint64_t v;
+	unsigned char c = *s++;
+
+	if (c >= 0300) {
+		v = f->w[c % 64];
+		for (unsigned int n = clo6[c % 64]; c = *s++, n > 0; n--) {
+			uint64_t occ = v ? f->w[v] : 0;
+			uint64_t bit = UINT64_C(1) << (c % 64);
+
+			if (!(occ & bit)) {
+				*in = false;
+				return s + n;
+			}
+			v = f->w[v + 1 + popcount64(occ & (bit - 1))];
+		}
+	} else if (c < 0200) {
+		v = f->w[c / 64];
+	} else {
+		return NULL; /* not the start of a rune */
+	}
+
+	*in = (v & (UINT64_C(1) << (c % 64))) != 0;
+
+	return s;
+}
+
+bool
+frozen_hasrune(const FrozenUTFSet *f, char32_t r)
+{
+	uint64_t v, occ, bit;
+	unsigned int n;
+
+	if (r >= 0x110000) {
+		return false;
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	v = f->w[64 - (64 >> n) + (r >> 6 * (n + 1))]; /* see addrune() */
+	for (; n > 0; n--) {
+		occ = v ? f->w[v] : 0;
+		bit = UINT64_C(1) << ((r >> 6 * n) % 64);
+		if (!(occ & bit)) {
+			return false;
+		}
+		v = f->w[v + 1 + popcount64(occ & (bit - 1))];
+	}
+	return (v & (UINT64_C(1) << (r % 64))) != 0;
+}
+
+/*
+ * frozen_hasrunes() is hasrunes() for a FrozenUTFSet. Here each step down the
+ * tree is two loads from the node, first of its occupancy mask, then of the
+ * child that tells us which is occupied, and as a node may span several cache
+ * lines, we prefetch for each of these in turn. Again there are no branches:
+ * a rune with no steps to go looks at the occupancy of node 0, as if it were
+ * empty, and one that finds its child isn't there is left with an empty mask.
+ */
+void
+frozen_hasrunes(const FrozenUTFSet *f, const char32_t *in, size_t n, uint8_t *out)
+{
+	uint64_t v[BATCH], hit[BATCH];
+	size_t pos[BATCH];
+	unsigned int left[BATCH];
+
+	for (size_t i = 0; i < n; i += BATCH) {
+		size_t k = n - i < BATCH ? n - i : BATCH;
+		const char32_t *r = in + i;
+		unsigned int more = 0;
+
+		for (size_t j = 0; j < k; j++) {
+			char32_t x = r[j] % 0x200000; /* see hasrunes() */
+
+			left[j] = (x >= 0x800) + (x >= 0x10000);
+			v[j] = f->w[64 - (64 >> left[j]) + (x >> 6 * (left[j] + 1))];
+			left[j] &= -(unsigned int)(v[j] != 0); /* no node */
+			prefetch(&f->w[v[j] & -(uint64_t)(left[j] > 0)]);
+			more |= left[j];
+		}
+		while (more) {
+			more = 0;
+			for (size_t j = 0; j < k; j++) {
+				uint64_t go = -(uint64_t)(left[j] > 0);
+				uint64_t occ = f->w[v[j] & go] & go;
+				uint64_t bit = UINT64_C(1) << ((r[j] >> 6 * left[j]) % 64);
+
+				hit[j] = -(uint64_t)((occ & bit) != 0);
+				pos[j] = (v[j] & go) + 1 + popcount64(occ & (bit - 1));
+				prefetch(&f->w[pos[j]]);
+			}
+			for (size_t j = 0; j < k; j++) {
+				uint64_t go = -(uint64_t)(left[j] > 0);
+
+				v[j] = pick(go, f->w[pos[j]] & hit[j], v[j]);
+				left[j] = (left[j] - 1) & hit[j];
+				prefetch(&f->w[v[j] & -(uint64_t)(left[j] > 0)]);
+				more |= left[j];
+			}
+		}
+		for (size_t j = 0; j < k; j++) {
+			out[i + j] = (v[j] >> (r[j] % 64) & 1) & (r[j] < 0x110000);
+		}
+	}
+}
+
+/*
+ * countbefore() returns how many runes come before the ith of the children at
+ * kids, from its counts if it has them, or else by adding up the popcounts of
+ * the children before it, which are then all bitmasks (or else empty).
+ * findchild() returns the index of the child in which the kth rune below the
+ * node lies, and subtracts from k the runes before that child. The counts are
+ * in ascending order, and the first is always 0, so we can search them by
+ * bisection, and there are at most 64 bitmasks to add up otherwise.
+ */
+static uint64_t
+countbefore(const uint64_t *kids, const uint64_t *cnt, unsigned int i)
+{
+	uint64_t count = 0;
+
+	if (cnt) {
+		return getcount(cnt, i);
+	}
+	for (unsigned int j = 0; j < i; j++) {
+		count += popcount64(kids[j]);
+	}
+	return count;
+}
+
+static unsigned int
+findchild(const uint64_t *kids, const uint64_t *cnt, unsigned int len, uint64_t *k)
+{
+	unsigned int lo = 0, hi = len;
+
+	if (!cnt) {
+		for (; *k >= popcount64(kids[lo]); lo++) {
+			*k -= popcount64(kids[lo]);
+		}
+		return lo;
+	}
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (getcount(cnt, mid) <= *k) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*k -= getcount(cnt, lo);
+	return lo;
+}
+
+/*
+ * rootbefore() and rootfind() are countbefore() and findchild() for the root,
+ * whose counts, if it has any, are only for the children that are nodes, and
+ * start with all of the runes in its first 32 children, which are bitmasks.
+ */
+static uint64_t
+rootbefore(const FrozenUTFSet *f, unsigned int c)
+{
+	const uint64_t *w = f->w;
+
+	if (f->len == ROOTLEN || c < 32) {
+		return countbefore(w, NULL, c < 32 ? c : 32);
+	}
+	return getcount(&w[ROOTLEN + 1], popcount64(w[ROOTLEN] & ((UINT64_C(1) << c) - 1)));
+}
+
+static unsigned int
+rootfind(const FrozenUTFSet *f, uint64_t *k)
+{
+	const uint64_t *w = f->w;
+	uint64_t nodes;
+	unsigned int i;
+
+	if (f->len == ROOTLEN || *k < getcount(&w[ROOTLEN + 1], 0)) {
+		return findchild(w, NULL, 32, k);
+	}
+	nodes = w[ROOTLEN];
+	i = findchild(NULL, &w[ROOTLEN + 1], popcount64(nodes) + 1, k);
+	for (; i > 0; i--) {
+		nodes &= nodes - 1;
+	}
+	return ctz64(nodes);
+}
+
+/*
+ * frozen_rank() returns how many runes in the set are less than r. It walks
+ * down the tree toward r just as frozen_hasrune() does, adding up the counts
+ * of the children to the left of its path at each step. Runes beyond U+1FFFFF
+ * have no path, so for those we count every rune that does. The counts also
+ * tell us how many runes are in the node we step down to, so when we reach a
+ * node whose children are bitmasks, and so has no counts, we can add up the
+ * popcounts of the children on whichever side of the path has fewer of them.
+ */
+size_t
+frozen_rank(const FrozenUTFSet *f, char32_t r)
+{
+	const uint64_t *w = f->w, *cnt;
+	uint64_t v, occ, bit;
+	unsigned int c, k, n;
+	size_t rank, size;
+
+	if (r >= 0x200000) {
+		return rootbefore(f, 56);
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	c = 64 - (64 >> n) + (r >> 6 * (n + 1)); /* see utfset_add_range() */
+	rank = rootbefore(f, c);
+	size = n > 0 ? rootbefore(f, c + 1) - rank : 0;
+	v = w[c];
+	for (; n > 0; n--) {
+		if (v == 0) {
+			return rank;
+		}
+		occ = w[v];
+		bit = UINT64_C(1) << ((r >> 6 * n) % 64);
+		c = popcount64(occ & (bit - 1));
+		k = popcount64(occ);
+		cnt = n > 1 ? &w[v + 1 + k] : NULL;
+		if (cnt || c <= k / 2) {
+			rank += countbefore(&w[v + 1], cnt, c);
+		} else {
+			rank += size - countbefore(&w[v + 1 + c], NULL, k - c);
+		}
+		if (!(occ & bit)) {
+			return rank;
+		}
+		if (cnt) {
+			size = getcount(cnt, c + 1) - getcount(cnt, c);
+		}
+		v = w[v + 1 + c];
+	}
+	return rank + popcount64(v & ((UINT64_C(1) << r % 64) - 1));
+}
+
+/*
+ * frozen_select() stores the kth rune in the set (counting from 0) in *r and
+ * returns true, or returns false if the set has no more than k runes, so that
+ * frozen_select(f, frozen_rank(f, r), &r) finds r again if it is in the set.
+ * We take the child in which the kth rune lies at each step down, and subtract
+ * from k the runes before it.
+ */
+bool
+frozen_select(const FrozenUTFSet *f, size_t k, char32_t *r)
+{
+	const uint64_t *w = f->w, *cnt;
+	uint64_t v, occ, left = k;
+	unsigned int c, i, n;
+	char32_t rv;
+
+	if (left >= rootbefore(f, 56)) {
+		return false;
+	}
+	c = rootfind(f, &left);
+	n = clo6[c];
+	rv = c % (64 >> n); /* see utfset_iter_next() */
+	v = w[c];
+	for (; n > 0; n--) {
+		occ = w[v];
+		cnt = n > 1 ? &w[v + 1 + popcount64(occ)] : NULL;
+		i = findchild(&w[v + 1], cnt, popcount64(occ), &left);
+		v = w[v + 1 + i];
+		for (; i > 0; i--) {
+			occ &= occ - 1;
+		}
+		rv = rv * 64 + ctz64(occ);
+	}
+	for (; left > 0; left--) {
+		v &= v - 1;
+	}
+	*r = rv * 64 + ctz64(v);
+	return true;
+}
+
+/*
+ * A FrozenUTFSet has no pointers, only offsets, so it can be written to a file
+ * just as it is, and later mapped back into memory and used straight away,
+ * with nothing to parse or allocate, and with the pages shared between every
+ * process that maps the same file. The file is two words, the magic number and
+ * the number of words in the array, followed by the array itself.
+ *
+ * The words are written in the machine's own byte order, so a file can only be
+ * mapped on a machine with the same byte order, which the magic number checks.
+ * Nor is the array itself checked, so files must come from a trusted source.
+ */
+#define MAGIC UINT64_C(0x3254455346545501) /* "\1UTFSET2" */
+
+/*
+ * frozen_save() writes the FrozenUTFSet to the file at path, and utfset_save()
+ * freezes the set and writes that. They return 0 on success, or -1 if we run
+ * out of memory or the file can't be written, in which case errno says why.
+ */
+int
+frozen_save(const FrozenUTFSet *f, const char *path)
+{
+	uint64_t hdr[2] = { MAGIC, f->len };
+	FILE *fp;
+	int ret = 0;
+
+	if (!(fp = fopen(path, "wb"))) {
+		return -1;
+	}
+	if (fwrite(hdr, sizeof(uint64_t), 2, fp) != 2 ||
+	    fwrite(f->w, sizeof(uint64_t), f->len, fp) != f->len) {
+		ret = -1;
+	}
+	if (fclose(fp) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+int
+utfset_save(const UTFSet *set, const char *path)
+{
+	FrozenUTFSet f;
+	int ret;
+
+	if (utfset_freeze(&f, set) < 0) {
+		return -1; /* out of memory */
+	}
+	ret = frozen_save(&f, path);
+	frozen_free(&f);
+	return ret;
+}
+
+/*
+ * utfset_map() loads a FrozenUTFSet from the file at path, written by one of
+ * the above, returning 0 on success or -1 if the file can't be read or is not
+ * one of ours. Where we can, we map the file read-only rather than read it, so
+ * that it costs nothing until its pages are touched. Otherwise we read it into
+ * memory we allocate. Either way, frozen_free() will clean up after it.
+ */
+int
+utfset_map(FrozenUTFSet *f, const char *path)
+{
+	uint64_t hdr[2];
+	void *mem;
+#if defined(HAVE_MMAP)
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); /* the mapping lives on without it */
+	if (mem == MAP_FAILED) {
+		return -1;
+	}
+	memcpy(hdr, mem, sizeof(hdr));
+	if (hdr[0] != MAGIC || hdr[1] < ROOTLEN || hdr[1] > SIZE_MAX / sizeof(uint64_t) ||
+	    (uint64_t)st.st_size != sizeof(hdr) + hdr[1] * sizeof(uint64_t)) {
+		munmap(mem, st.st_size);
+		return -1;
+	}
+	f->maplen = st.st_size;
+	f->mem = mem;
+	f->w = (const uint64_t *)mem + 2;
+#else
+	FILE *fp;
+
+	if (!(fp = fopen(path, "rb"))) {
+		return -1;
+	}
+	if (fread(hdr, sizeof(uint64_t), 2, fp) != 2 || hdr[0] != MAGIC || hdr[1] < ROOTLEN ||
+	    hdr[1] > SIZE_MAX / sizeof(uint64_t) || !(mem = malloc(hdr[1] * sizeof(uint64_t)))) {
+		fclose(fp);
+		return -1;
+	}
+	if (fread(mem, sizeof(uint64_t), hdr[1], fp) != hdr[1] || getc(fp) != EOF) {
+		free(mem);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	f->maplen = 0;
+	f->mem = mem;
+	f->w = mem;
+#endif
+	f->len = hdr[1];
+	return 0;
+}
+
+/*
+ * For the same reason, a FrozenUTFSet can be written out as C source, so that
+ * sets which are known when a program is built, such as whitespace and other
+ * character classes, can be compiled into it as read-only data, with nothing
+ * to build at run time: not even a file to map. A small program run as part of
+ * the build can construct each set as usual, and then call utfset_emit(). If,
+ * say, name is "space", then the generated source will define
+ *
+ *	static const uint64_t space_w[] = { ... };
+ *	static const FrozenUTFSet space = { space_w, ... };
+ *
+ * after which frozen_hasrune(&space, r) and so on can be used as for any other
+ * FrozenUTFSet. It is const, though, and was never allocated, so it must not be
+ * passed to frozen_free(), which would try to clear it.
+ *
+ * frozen_emit() emits a FrozenUTFSet, and utfset_emit() freezes a set and emits
+ * that. They return 0 on success, or -1 if we run out of memory or there is an
+ * error writing to fp.
+ */
+int
+frozen_emit(const FrozenUTFSet *f, FILE *fp, const char *name)
+{
+	fprintf(fp, "static const uint64_t %s_w[] = {", name);
+	for (size_t i = 0; i < f->len; i++) {
+		fprintf(fp, "%sUINT64_C(0x%016" PRIX64 "),", i % 4 ? " " : "\n\t", f->w[i]);
+	}
+	fprintf(fp, "\n};\n");
+	fprintf(fp, "static const FrozenUTFSet %s = { %s_w, %zu, NULL, 0 };\n", name, name, f->len);
+	return ferror(fp) ? -1 : 0;
+}
+
+int
+utfset_emit(const UTFSet *set, FILE *fp, const char *name)
+{
+	FrozenUTFSet f;
+	int ret;
+
+	if (utfset_freeze(&f, set) < 0) {
+		return -1; /* out of memory */
+	}
+	ret = frozen_emit(&f, fp, name);
+	frozen_free(&f);
+	return ret;
+}
+
+/*
+ * Even a FrozenUTFSet needs a step down the tree for each byte of a rune, and
+ * which steps depends on how long the rune is. For the innermost loops, a set
+ * can instead be compiled into a UTFTable, a three-stage lookup table indexed
+ * by the rune itself, much like those used by ICU: the top 9 bits of the rune
+ * index s1, giving the start of a block in s2, the next 6 bits index within
+ * that block, giving the index of a bitmask, and the last 6 bits index within
+ * the bitmask. So any rune up to U+1FFFFF takes exactly three dependent loads,
+ * and no branches at all:
+ *
+ *	bits[s2[s1[r >> 12] + (r >> 6) % 64]] >> (r % 64) & 1
+ *
+ * The table stays small because both the blocks and the bitmasks are shared:
+ * any two that are the same are only stored once, and in particular all of the
+ * empty ones are block 0 and bitmask 0, which are all zeros. There can be no
+ * more than 513 distinct blocks, nor 32769 distinct bitmasks, so 16 bits are
+ * always enough for an index.
+ *
+ * The arrays are allocated by utfset_compile(), in a single piece of memory,
+ * kept in mem, to be freed by table_free(). Its size in bytes is kept in size,
+ * for comparison with the other forms that the set can take.
+ */
+typedef struct utftable {
+	const uint16_t *s1;     /* 512 block offsets, by r >> 12 */
+	const uint16_t *s2;     /* blocks of 64 bitmask indices */
+	const uint64_t *bits;   /* distinct bitmasks */
+	size_t nblocks, nbits;
+	size_t size;            /* bytes in all */
+	void *mem;
+} UTFTable;
+
+static void spread1(union child, unsigned int, char32_t, uint64_t *);
+static int compile1(UTFTable *, const uint64_t *, uint16_t *, uint64_t *, uint16_t *, uint16_t *);
+
+/*
+ * utfset_compile() compiles the set into t, returning 0 on success or -1 if we
+ * run out of memory. Overlong sequences, and any runes beyond U+1FFFFF, which
+ * can only get into the set through addutf() with invalid input, are left out.
+ *
+ * First we spread the whole set out into a bitmask for each run of 64 runes,
+ * which is easy to index by rune. compile1() does the rest, in the working
+ * space we allocate for it here.
+ */
+int
+utfset_compile(UTFTable *t, const UTFSet *set)
+{
+	uint64_t *masks = calloc(0x8000, sizeof(uint64_t));
+	uint64_t *bits = malloc((0x8000 + 1) * sizeof(uint64_t));
+	uint16_t *hash = calloc(0x10000, sizeof(uint16_t));
+	uint16_t *idx = malloc(0x8000 * sizeof(uint16_t));
+	uint16_t *blks = malloc((512 + 1) * 64 * sizeof(uint16_t));
+	int ret = -1;
+
+	if (masks && bits && hash && idx && blks) {
+		for (unsigned char c = 0; c < 64; c++) {
+			unsigned int n = clo6[c];
+			char32_t r;
+
+			if (n == 0) {
+				masks[c] = set->blk[c].bits;
+			} else if (n <= 2 && set->blk[c].ptr) {
+				r = (char32_t)(c - (64 - (64 >> n))) << 6 * (n + 1);
+				for (unsigned int i = 0; i < 64; i++, r += (char32_t)1 << 6 * n) {
+					if (r >= first[n]) {
+						spread1(set->blk[c].ptr->blk[i], n - 1, r, masks);
+					}
+				}
+			}
+		}
+		ret = compile1(t, masks, hash, bits, idx, blks);
+	}
+	free(masks);
+	free(bits);
+	free(hash);
+	free(idx);
+	free(blks);
+	return ret;
+}
+
+/*
+ * spread1() ors each bitmask beneath a node, with n bytes still to go after it,
+ * into masks, given the first rune the node covers.
+ */
+void
+spread1(union child t, unsigned int n, char32_t r, uint64_t *masks)
+{
+	if (n == 0) {
+		masks[r >> 6] |= t.bits;
+	} else if (t.ptr) {
+		for (unsigned int c = 0; c < 64; c++) {
+			spread1(t.ptr->blk[c], n - 1, r + ((char32_t)c << 6 * n), masks);
+		}
+	}
+}
+
+/*
+ * compile1() finds the distinct bitmasks among masks, storing them in bits and
+ * the index of each in idx, with the help of a hash table, whose slots hold
+ * the indices of the bitmasks in it, or 0 if they are empty (bitmask 0 is empty
+ * too, and is never looked for). Then it finds the distinct blocks of indices,
+ * storing them in blks. There are few enough of those to find the same ones by
+ * comparing them with every other. Finally it copies the lot into t.
+ */
+int
+compile1(UTFTable *t, const uint64_t *masks, uint16_t *hash, uint64_t *bits, uint16_t *idx, uint16_t *blks)
+{
+	uint16_t s1[512];
+	size_t nbits = 1, nblocks = 1;
+	char *mem;
+
+	bits[0] = 0;
+	for (size_t i = 0; i < 0x8000; i++) {
+		size_t h = (masks[i] * UINT64_C(0x9E3779B97F4A7C15)) >> 48;
+
+		if (masks[i] == 0) {
+			idx[i] = 0;
+			continue;
+		}
+		while (hash[h] != 0 && bits[hash[h]] != masks[i]) {
+			h = (h + 1) % 0x10000;
+		}
+		if (hash[h] == 0) {
+			bits[nbits] = masks[i];
+			hash[h] = nbits++;
+		}
+		idx[i] = hash[h];
+	}
+
+	memset(blks, 0, 64 * sizeof(uint16_t));
+	for (size_t b = 0; b < 512; b++) {
+		size_t j = 0;
+
+		while (j < nblocks && memcmp(&blks[j * 64], &idx[b * 64], 64 * sizeof(uint16_t)) != 0) {
+			j++;
+		}
+		if (j == nblocks) {
+			memcpy(&blks[j * 64], &idx[b * 64], 64 * sizeof(uint16_t));
+			nblocks++;
+		}
+		s1[b] = j * 64;
+	}
+
+	t->nbits = nbits;
+	t->nblocks = nblocks;
+	t->size = nbits * sizeof(uint64_t) + sizeof(s1) + nblocks * 64 * sizeof(uint16_t);
+	if (!(mem = t->mem = malloc(t->size))) {
+		return -1; /* out of memory */
+	}
+	memcpy(mem, bits, nbits * sizeof(uint64_t));
+	t->bits = (const uint64_t *)mem;
+	mem += nbits * sizeof(uint64_t);
+	memcpy(mem, s1, sizeof(s1));
+	t->s1 = (const uint16_t *)mem;
+	mem += sizeof(s1);
+	memcpy(mem, blks, nblocks * 64 * sizeof(uint16_t));
+	t->s2 = (const uint16_t *)mem;
+	return 0;
+}
+
+/*
+ * table_free() frees the arrays of a UTFTable, if it has any to free.
+ */
+void
+table_free(UTFTable *t)
+{
+	free(t->mem);
+	*t = (UTFTable){ 0 };
+}
+
+/*
+ * table_hasrune() and table_hasutf() are just like hasrune() and hasutf(), but
+ * for a UTFTable. For UTF-8, we branch on the length of the rune to decode it,
+ * but then the lookup is the same for every rune. Leading bytes that are not
+ * followed by between one and three continuation bytes can't be in the table.
+ */
+bool
+table_hasrune(const UTFTable *t, char32_t r)
+{
+	return r < 0x200000 && (t->bits[t->s2[t->s1[r >> 12] + (r >> 6) % 64]] >> (r % 64) & 1);
+}
+
+const char *
+table_hasutf(const UTFTable *t, const char *s, bool *in)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	char32_t r;
+
+	if (p[0] < 0200) {
+		r = p[0];
+		s += 1;
+	} else if (p[0] < 0300) {
+		return NULL; /* not the start of a rune */
+	} else {
+		switch (clo6[p[0] % 64]) {
+		case 0:
+			r = (p[0] % 32) << 6 | p[1] % 64;
+			s += 2;
+			break;
+		case 1:
+			r = (p[0] % 16) << 12 | (p[1] % 64) << 6 | p[2] % 64;
+			s += 3;
+			break;
+		case 2:
+			r = (char32_t)(p[0] % 8) << 18 | (p[1] % 64) << 12 | (p[2] % 64) << 6 | p[3] % 64;
+			s += 4;
+			break;
+		default:
+			*in = false;
+			return s + clo6[p[0] % 64] + 2;
+		}
+	}
+
+	*in = t->bits[t->s2[t->s1[r >> 12] + (r >> 6) % 64]] >> (r % 64) & 1;
+
+	return s;
+}
+
+/*
+ * A UTFMultiset is a UTFSet that counts how many times each rune was added to
+ * it. Its tree is just the same, except that where a UTFSet would have had a
+ * bitmask, we instead have a pointer to an array of 64 counts, allocated only
+ * once a rune is added beneath it. The counts are 32 bits each, and saturate
+ * rather than wrap around, so a count of UINT32_MAX means at least that many.
+ *
+ * We don't store all 32 bits together, though. With runes from all over the
+ * place, a multiset would then take four times as much memory in counts as its
+ * runes are spread across, and nearly every increment would miss the cache.
+ * Instead each array holds only the low 8 bits of its counts, so that they fit
+ * in one or two cache lines, with a pointer to the high 24 bits, which are only
+ * allocated once one of the counts first goes past 255. Carrying into them is
+ * the only time we need to look at them, which is once every 256 increments,
+ * and only for those runes that are added that often.
+ *
+ * An initializer of { 0 } gives an empty multiset. Its blocks and counts are
+ * always allocated with calloc(), rather than from a pool.
+ */
+struct counts {
+	uint8_t lo[64];
+	struct highcounts *hi;
+};
+
+struct highcounts {
+	uint32_t n[64];
+};
+
+typedef struct utfmultiset {
+	union child blk[64];
+} UTFMultiset;
+
+static int carry(struct counts *, unsigned int);
+
+/*
+ * countof() returns the count of the cth rune under a child of a UTFMultiset.
+ */
+static inline uint32_t
+countof(union child t, unsigned int c)
+{
+	if (!t.cnt) {
+		return 0;
+	}
+	return (t.cnt->hi ? t.cnt->hi->n[c] << 8 : 0) | t.cnt->lo[c];
+}
+
+/*
+ * multiset_addutfs() adds every rune in the first len bytes of the UTF-8 string
+ * to the multiset, and returns a pointer to the byte following the last rune
+ * added, just as addutfs() does, and for the same reasons the descent for each
+ * rune is unrolled by its length. Unlike addutfs(), it stops at a leading byte
+ * of more than four bytes, rather than giving the rune four levels of blocks.
+ */
+const char *
+multiset_addutfs(UTFMultiset *ms, const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + len;
+	const unsigned char *q;
+	union child *tp;
+
+	while (p < end) {
+		unsigned char c = *p;
+		unsigned int n;
+
+		if (c < 0200) {
+			tp = &ms->blk[c / 64]; /* see addutf() */
+			q = p;
+			n = 0;
+		} else if (c < 0300) {
+			break; /* continuation byte */
+		} else if ((n = clo6[c % 64]) > 2 || (size_t)(end - p) < n + 2) {
+			break; /* cut short, or not a leading byte we can handle */
+		} else {
+			tp = &ms->blk[c % 64];
+			q = p + 1;
+			switch (n) {
+			case 2:
+				if (!tp->ptr && !(tp->ptr = newblock(NULL))) {
+					return (const char *)p; /* out of memory */
+				}
+				tp = &tp->ptr->blk[*q++ % 64];
+				/* fallthrough */
+			case 1:
+				if (!tp->ptr && !(tp->ptr = newblock(NULL))) {
+					return (const char *)p; /* out of memory */
+				}
+				tp = &tp->ptr->blk[*q++ % 64];
+			}
+		}
+
+		if (!tp->cnt && !(tp->cnt = calloc(1, sizeof(struct counts)))) {
+			return (const char *)p; /* out of memory */
+		}
+		if (++tp->cnt->lo[*q % 64] == 0 && carry(tp->cnt, *q % 64) < 0) {
+			return (const char *)p; /* out of memory */
+		}
+		p = q + 1;
+	}
+
+	return (const char *)p;
+}
+
+/*
+ * carry() carries the cth of the counts, whose low 8 bits have just wrapped
+ * around to 0, into its high bits, allocating them if need be. If the count
+ * was already UINT32_MAX, it is saturated, and stays that way. It returns 0 on
+ * success, or -1 if we run out of memory, in which case the count is put back
+ * as it was.
+ */
+int
+carry(struct counts *cp, unsigned int c)
+{
+	if (!cp->hi && !(cp->hi = calloc(1, sizeof(*cp->hi)))) {
+		cp->lo[c] = UINT8_MAX;
+		return -1; /* out of memory */
+	}
+	if (cp->hi->n[c] == UINT32_MAX >> 8) {
+		cp->lo[c] = UINT8_MAX; /* saturated */
+	} else {
+		cp->hi->n[c]++;
+	}
+	return 0;
+}
+
+/*
+ * multiset_count() returns how many times the rune has been added. It finds its
+ * way down the tree just as hasrune() does.
+ */
+uint32_t
+multiset_count(const UTFMultiset *ms, char32_t r)
+{
+	const union child *tp;
+	unsigned int n;
+
+	if (r >= 0x200000) {
+		return 0; /* too long for multiset_addutfs() to have added */
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	tp = &ms->blk[64 - (64 >> n) + (r >> 6 * (n + 1))];
+	for (; n > 0; n--) {
+		if (!tp->ptr) {
+			return 0;
+		}
+		tp = &tp->ptr->blk[(r >> 6 * n) % 64];
+	}
+	return countof(*tp, r % 64);
+}
+
+static int mforeach1(union child, unsigned int, char32_t, int (*)(char32_t, uint32_t, void *), void *);
+
+/*
+ * multiset_foreach() calls the function for each rune in the multiset, in the
+ * same order as foreach(), passing it the rune, its count, and the context
+ * pointer. It stops early if the function returns nonzero, and returns that
+ * value, as foreach_ctx() does; otherwise it returns 0.
+ */
+int
+multiset_foreach(const UTFMultiset *ms, int (*fcn)(char32_t, uint32_t, void *), void *ctx)
+{
+	int ret;
+
+	for (unsigned char c = 0; c < 64; c++) {
+		unsigned int n = clo6[c];
+
+		if (n <= 2 && (ret = mforeach1(ms->blk[c], n, c % (64 >> n), fcn, ctx)) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * mforeach1() visits a node with n bytes still to go after it, given the bits
+ * of the rune so far, as in utfset_iter_next().
+ */
+int
+mforeach1(union child t, unsigned int n, char32_t r, int (*fcn)(char32_t, uint32_t, void *), void *ctx)
+{
+	int ret;
+
+	if (n == 0 && t.cnt) {
+		for (unsigned int c = 0; c < 64; c++) {
+			if (countof(t, c) && (ret = fcn(r * 64 | c, countof(t, c), ctx)) != 0) {
+				return ret;
+			}
+		}
+	} else if (n > 0 && t.ptr) {
+		for (unsigned int c = 0; c < 64; c++) {
+			if ((ret = mforeach1(t.ptr->blk[c], n - 1, r * 64 | c, fcn, ctx)) != 0) {
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static void mfree1(union child, unsigned int);
+
+/*
+ * multiset_free() frees all of the blocks and counts in the multiset, which is
+ * left empty.
+ */
+void
+multiset_free(UTFMultiset *ms)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		mfree1(ms->blk[c], clo6[c]);
+		ms->blk[c] = (union child){ 0 };
+	}
+}
+
+void
+mfree1(union child t, unsigned int n)
+{
+	if (n == 0) {
+		if (t.cnt) {
+			free(t.cnt->hi);
+		}
+		free(t.cnt);
+	} else if (t.ptr) {
+		for (unsigned char c = 0; c < 64; c++) {
+			mfree1(t.ptr->blk[c], n - 1);
+		}
+		free(t.ptr);
+	}
+}
+
+/*
+ * A UTFMap maps each rune to a 32-bit value, such as its script, its width, or
+ * the difference between it and its case folding, with runes not given any
+ * value mapping to 0. Again its tree is that of a UTFSet, with an array of 64
+ * values in place of each bitmask, but since such properties tend to be the
+ * same for long runs of runes, any child whose runes all map to the same value
+ * stores that value in place of a pointer, and has nothing allocated beneath
+ * it. Pointers are always even, so we tell the two apart by setting the bottom
+ * bit, with the value itself in the top 32 bits; and a null pointer is simply
+ * a child mapping all of its runes to 0.
+ *
+ * An initializer of { 0 } gives an empty map. Like a UTFMultiset, it allocates
+ * everything with calloc().
+ */
+struct values {
+	int32_t v[64];
+};
+
+typedef struct utfmap {
+	union child blk[64];
+} UTFMap;
+
+/*
+ * isuniform() tests whether a child of a UTFMap maps all of its runes to the
+ * same value, and uniform() makes a child that does, or returns its value.
+ */
+static inline bool
+isuniform(union child t)
+{
+	return t.bits % 2 == 1 || !t.ptr;
+}
+
+static inline union child
+uniform(int32_t v)
+{
+	return (union child){ .bits = v ? (uint64_t)(uint32_t)v << 32 | 1 : 0 };
+}
+
+static inline int32_t
+uniformval(union child t)
+{
+	return (int32_t)(uint32_t)(t.bits >> 32);
+}
+
+static int setspan(union child *, unsigned int, char32_t, char32_t, int32_t);
+static void mapfree1(union child, unsigned int);
+
+/*
+ * map_set_range() maps every rune from lo up to hi inclusive to v, splitting
+ * the range between children as utfset_add_range() does. A child entirely
+ * within the range becomes uniform, whatever was beneath it before, and one
+ * which ends up with all of its runes mapping to the same value is collapsed
+ * back into a uniform child. Returns 0 on success, or -1 if the range is empty
+ * or beyond U+10FFFF, or if we run out of memory, in which case only some of
+ * the runes may have been mapped.
+ */
+int
+map_set_range(UTFMap *map, char32_t lo, char32_t hi, int32_t v)
+{
+	if (lo > hi || hi >= first[3]) {
+		return -1; /* invalid range */
+	}
+	for (unsigned int n = 0; n < 3; n++) {
+		char32_t a = lo > first[n] ? lo : first[n];
+		char32_t b = hi < first[n + 1] - 1 ? hi : first[n + 1] - 1;
+
+		if (a <= b && setspan(&map->blk[64 - (64 >> n)], n, a, b, v) < 0) {
+			return -1; /* out of memory */
+		}
+	}
+	return 0;
+}
+
+/*
+ * map_set() maps a single rune to v.
+ */
+int
+map_set(UTFMap *map, char32_t r, int32_t v)
+{
+	return map_set_range(map, r, r, v);
+}
+
+/*
+ * setspan() is the workhorse for map_set_range(), just as addspan() is for
+ * utfset_add_range(). Where the range covers only part of a uniform child, we
+ * first give it an array or block as full of its value as it was before.
+ */
+int
+setspan(union child *blk, unsigned int n, char32_t lo, char32_t hi, int32_t v)
+{
+	unsigned int shift = 6 * (n + 1);
+	char32_t size = (char32_t)1 << shift;
+
+	for (char32_t i = lo >> shift; i <= hi >> shift; i++) {
+		char32_t clo = i == lo >> shift ? lo % size : 0;
+		char32_t chi = i == hi >> shift ? hi % size : size - 1;
+		union child *t = &blk[i];
+		bool same = true;
+
+		if (clo == 0 && chi == size - 1) {
+			mapfree1(*t, n);
+			*t = uniform(v);
+			continue;
+		} else if (isuniform(*t) && uniformval(*t) == v) {
+			continue; /* nothing to change */
+		}
+
+		if (n == 0) {
+			if (isuniform(*t)) {
+				int32_t u = uniformval(*t);
+
+				if (!(t->val = malloc(sizeof(struct values)))) {
+					*t = uniform(u);
+					return -1; /* out of memory */
+				}
+				for (unsigned int c = 0; c < 64; c++) {
+					t->val->v[c] = u;
+				}
+			}
+			for (char32_t c = clo; c <= chi; c++) {
+				t->val->v[c] = v;
+			}
+			for (unsigned int c = 1; c < 64; c++) {
+				same &= t->val->v[c] == t->val->v[0];
+			}
+			if (same) {
+				int32_t u = t->val->v[0];
+
+				free(t->val);
+				*t = uniform(u);
+			}
+		} else {
+			if (isuniform(*t)) {
+				union child u = *t;
+
+				if (!(t->ptr = newblock(NULL))) {
+					*t = u;
+					return -1; /* out of memory */
+				}
+				for (unsigned int c = 0; c < 64; c++) {
+					t->ptr->blk[c] = u;
+				}
+			}
+			if (setspan(t->ptr->blk, n - 1, clo, chi, v) < 0) {
+				return -1;
+			}
+			for (unsigned int c = 0; c < 64; c++) {
+				same &= isuniform(t->ptr->blk[c]) && t->ptr->blk[c].bits == t->ptr->blk[0].bits;
+			}
+			if (same) {
+				union child u = t->ptr->blk[0];
+
+				free(t->ptr);
+				*t = u;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * map_getutf() looks up the next rune in the UTF-8 string, storing its value in
+ * *v, and returns a pointer to the byte following that rune, or NULL if the
+ * string doesn't start with a rune. Like hasutf(), it needs at most one load
+ * per byte, and fewer if it runs into a uniform child on the way down.
+ */
+const char *
+map_getutf(const UTFMap *map, const char *s, int32_t *v)
+{
+	const union child *tp;
+	unsigned char c = *s++;
+
+	if (c >= 0300) {
+		tp = &map->blk[c % 64];
+		for (unsigned int n = clo6[c % 64]; c = *s++, n > 0; n--) {
+			if (isuniform(*tp)) {
+				*v = uniformval(*tp);
+				return s + n;
+			}
+			tp = &tp->ptr->blk[c % 64];
+		}
+	} else if (c < 0200) {
+		tp = &map->blk[c / 64]; /* see addutf() */
+	} else {
+		return NULL; /* not the start of a rune */
+	}
+
+	*v = isuniform(*tp) ? uniformval(*tp) : tp->val->v[c % 64];
+
+	return s;
+}
+
+/*
+ * map_get() looks up the value of the rune itself, finding its way down the
+ * tree as hasrune() does. Runes beyond U+10FFFF map to 0.
+ */
+int32_t
+map_get(const UTFMap *map, char32_t r)
+{
+	const union child *tp;
+	unsigned int n;
+
+	if (r >= first[3]) {
+		return 0;
+	}
+	n = r < 0x800 ? 0 : r < 0x10000 ? 1 : 2;
+	tp = &map->blk[64 - (64 >> n) + (r >> 6 * (n + 1))];
+	for (; n > 0; n--) {
+		if (isuniform(*tp)) {
+			return uniformval(*tp);
+		}
+		tp = &tp->ptr->blk[(r >> 6 * n) % 64];
+	}
+	return isuniform(*tp) ? uniformval(*tp) : tp->val->v[r % 64];
+}
+
+/*
+ * map_free() frees everything allocated for the map, which is left empty.
+ */
+void
+map_free(UTFMap *map)
+{
+	for (unsigned char c = 0; c < 64; c++) {
+		mapfree1(map->blk[c], clo6[c]);
+		map->blk[c] = (union child){ 0 };
+	}
+}
+
+void
+mapfree1(union child t, unsigned int n)
+{
+	if (isuniform(t)) {
+		return;
+	} else if (n == 0) {
+		free(t.val);
+	} else {
+		for (unsigned char c = 0; c < 64; c++) {
+			mapfree1(t.ptr->blk[c], n - 1);
+		}
+		free(t.ptr);
+	}
+}
+
+/*
+ * The following are examples of how this data structure is to be used.
+ */
+
+/*
+ * prune() is an example function for passing to foreach(). It prints the rune
+ * it is passed, in the usual U+0000 format, to stdout.
+ */
+void
+prune(char32_t r)
+{
+	printf("U+%04" PRIX32 "\n", (uint32_t)r);
+}
+
+/*
+ * prunes() is an example function which, given a UTF-8 string, will print the
+ * runes it contains in ascending order. Returns 0 on success, -1 on failure.
+ */
+int
+prunes(const char *s)
+{
+	UTFSet set = { 0 }; /* empty set */
+	size_t len = strlen(s);
+
+	if (addutfs(&set, s, len) != s + len) {
+		utfset_free(&set);
+		return -1; /* something went wrong */
+	}
+
 	foreach(&set, &prune); /* print all runes */
+	utfset_free(&set);
 	return 0;
 }